@@ -35,9 +35,10 @@
     { 'target_name': '04_fs_readasync'         , 'sources': [ './src/04_fs_readasync.c' ] }         ,
     { 'target_name': '05_fs_readasync_context' , 'sources': [ './src/05_fs_readasync_context.c' ] } ,
     { 'target_name': '06_fs_allasync'          , 'sources': [ './src/06_fs_allasync.c' ] }          ,
-    { 'target_name': '07_tcp_echo_server'      , 'sources': [ './src/07_tcp_echo_server.c' ] }      ,
+    { 'target_name': '07_tcp_echo_server'      , 'sources': [ './src/07_tcp_echo_server.c', './src/luv_framer.h', './src/luv_framer.c' ] } ,
+    { 'target_name': 'echo_bench'              , 'sources': [ './src/echo_bench.c', './src/luv_hist.h', './src/luv_hist.c' ] } ,
     { 'target_name': '08_horse_race',
-      'sources': [ './src/08_horse_race.c' ],
+      'sources': [ './src/08_horse_race.c', './src/luv_rand.h', './src/luv_rand.c' ],
       'conditions': [ 
         ['OS in "freebsd openbsd solaris android linux mac"', {
           'ldflags': [ '-lncurses' ],
@@ -61,6 +62,56 @@
         './src/interactive_horse_race/tcp_server.c',
         './src/interactive_horse_race/track.c',
         './src/interactive_horse_race/questions.c',
+        './src/interactive_horse_race/rooms.c',
+        './src/interactive_horse_race/recorder.c',
+        './src/luv_framer.h',
+        './src/luv_framer.c',
+        './src/luv_rand.h',
+        './src/luv_rand.c',
+      ],
+      'conditions': [ 
+        ['OS in "freebsd openbsd solaris android linux mac"', {
+          'ldflags': [ '-lncurses' ],
+          'cflags': [ '--std=gnu99' ],
+        }],
+        ['OS in "linux"', {
+          'libraries': [ '-lncurses' ]
+        }]
+      ],
+      'xcode_settings': {
+        'OTHER_LDFLAGS': [
+          '-lncurses'
+        ],
+      }
+    },
+    { 'target_name': 'race_bench',
+      'include_dirs': [ './src/interactive_horse_race/' ],
+      'sources': [ 
+        './src/interactive_horse_race/interactive_horse_race.h',
+        './src/interactive_horse_race/race_bench.c',
+        './src/interactive_horse_race/questions.c',
+        './src/luv_framer.h',
+        './src/luv_framer.c',
+        './src/luv_rand.h',
+        './src/luv_rand.c',
+        './src/luv_hist.h',
+        './src/luv_hist.c',
+      ],
+      'conditions': [ 
+        ['OS in "freebsd openbsd solaris android linux mac"', {
+          'cflags': [ '--std=gnu99' ],
+        }],
+      ],
+    },
+    { 'target_name': 'race_replay',
+      'include_dirs': [ './src/interactive_horse_race/' ],
+      'sources': [ 
+        './src/interactive_horse_race/interactive_horse_race.h',
+        './src/interactive_horse_race/race_replay.c',
+        './src/interactive_horse_race/track.c',
+        './src/interactive_horse_race/recorder.c',
+        './src/luv_rand.h',
+        './src/luv_rand.c',
       ],
       'conditions': [ 
         ['OS in "freebsd openbsd solaris android linux mac"', {
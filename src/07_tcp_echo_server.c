@@ -1,160 +1,1517 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* sendmmsg */
+#endif
 #include "learnuv.h"
-#include <math.h>
+#include "luv_framer.h"
+#include <sys/socket.h>
 
 const static char *HOST = "0.0.0.0"; /* localhost */
 const static int PORT = 7001;
-const static int NBUFS = 1; /* number of buffers we write at once */
+#define MAX_NBUFS 64 /* max number of buffers we coalesce into one write */
+const static int MAX_LOOPS = 64;
+const static int POOL_SLAB_ITEMS = 64; /* objects carved out of one slab allocation */
+#define UDP_BATCH 20                       /* datagrams one recvmmsg call can return, libuv caps it at 20 */
+const static size_t UDP_DGRAM_MAX = 65536; /* libuv splits recvmmsg buffers into chunks of this size */
+const static uint64_t UDP_POOL_MAX = 4;    /* batch buffers per loop, each is UDP_BATCH * UDP_DGRAM_MAX bytes */
+const static int64_t SENDFILE_CHUNK = 1024 * 1024; /* bytes per uv_fs_sendfile call */
 
-static uv_tcp_t tcp_server;
+#ifndef __ROOT__
+#define __ROOT__ "."
+#endif
 
+#define WHEEL_SLOTS 512
+const static uint64_t WHEEL_TICK_MS = 100;
+
+typedef struct echo_conn_s echo_conn_t;
+
+/*
+ * Fixed-size object pool used for read buffers and write requests.
+ * Objects are carved out of slabs and recycled through a freelist so the hot path doesn't hit the allocator.
+ * Once `max_items` objects are handed out we fall back to malloc, which is counted as a miss,
+ * and those objects are returned to the heap when released.
+ */
+typedef struct pool_item_s
+{
+  struct pool_s *pool;      /* NULL if the object came from malloc */
+  struct pool_item_s *next; /* freelist link while the object is not in use */
+} pool_item_t;
+
+typedef struct pool_slab_s
+{
+  struct pool_slab_s *next;
+  void *pad; /* keeps the items that follow 16 byte aligned */
+} pool_slab_t;
+
+typedef struct pool_s
+{
+  size_t item_size;
+  uint64_t max_items;
+  int slab_items; /* objects per slab, fewer than POOL_SLAB_ITEMS for pools that never hold that many */
+  pool_slab_t *slabs;
+  pool_item_t *free;
+  uint64_t capacity;
+  uint64_t in_use;
+  uint64_t high_water; /* most objects handed out at once */
+  uint64_t hits;
+  uint64_t misses;
+} pool_t;
+
+/*
+ * Hashed timer wheel for the idle and read timeouts of all connections of a loop.
+ * A single uv_timer_t ticks every WHEEL_TICK_MS and visits one slot, connections hash into the slot of their deadline
+ * and ones due in a later rotation are skipped.
+ * Reads and writes only update timestamps on the connection, the deadline is recomputed when its slot comes up,
+ * so a busy connection is moved at most once per timeout instead of on every read.
+ */
+typedef struct
+{
+  uv_timer_t timer;
+  echo_conn_t *slots[WHEEL_SLOTS];
+  uint64_t tick; /* next tick to process, a tick is `WHEEL_TICK_MS` of loop time */
+} timer_wheel_t;
+
+/*
+ * Each echo loop owns a uv_loop_t and a listening socket.
+ * In the default mode there is exactly one, running on `uv_default_loop()` in the main thread.
+ * With `--loops N` we spawn N threads which all bind port 7001 with SO_REUSEPORT,
+ * so the kernel spreads incoming connections across them.
+ * The counters are only ever written by the thread owning the loop.
+ */
 typedef struct
 {
-  uv_write_t req;
-  uv_buf_t buf;
-} write_req_t;
+  uv_loop_t *loop;
+  uv_tcp_t tcp_server;
+  uv_udp_t udp_server;
+  struct udp_batch_s *udp_batch; /* buffer of the recvmmsg call in progress */
+  uv_thread_t thread;
+  uv_async_t drain_async; /* wakes the loop up to drain once any loop received QUIT */
+  uv_timer_t drain_timer; /* drain deadline, connections still open then are closed */
+  timer_wheel_t wheel;
+  int draining;
+  int id;
+  echo_conn_t *conns; /* open connections, so draining can reach them */
+  uint64_t connections;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t messages;    /* reads we echoed */
+  uint64_t try_writes;  /* uv_try_write calls, each one is a write syscall */
+  uint64_t writes;      /* queued uv_write calls, each one covering up to MAX_NBUFS chunks with one writev */
+  uint64_t coalesced;   /* chunks that shared a writev with another chunk */
+  uint64_t paused;      /* gauge of connections whose reading is stopped due to backpressure */
+  uint64_t pauses;      /* how often we had to stop reading from a client */
+  uint64_t reaps;       /* connections shut down because they timed out */
+  uint64_t datagrams;   /* UDP datagrams echoed */
+  uint64_t udp_batches; /* recvmmsg calls that returned datagrams */
+  uint64_t udp_sends;   /* send syscalls for the replies, sendmmsg or queued uv_udp_send */
+  uint64_t transfers;      /* files sent with SEND */
+  uint64_t sendfile_bytes; /* bytes sent with uv_fs_sendfile */
+  uint64_t sendfile_ns;    /* time spent on those transfers */
+  uint64_t copy_bytes;     /* bytes sent with uv_fs_read + uv_write, see --send-mode */
+  uint64_t copy_ns;
+  uint64_t udp_batch_sizes[UDP_BATCH + 1]; /* histogram of datagrams per recvmmsg call */
+  pool_t buf_pool;
+  pool_t req_pool;
+  pool_t udp_pool;
+  pool_t udp_req_pool;
+} echo_loop_t;
+
+typedef struct
+{
+  int loops;         /* 0 runs a single loop on uv_default_loop(), otherwise one thread per loop */
+  size_t buf_size;   /* size of each pooled read buffer */
+  uint64_t pool_max; /* pool high-water mark, objects handed out beyond it come from malloc */
+  size_t high_watermark; /* stop reading from a client once this many bytes wait to be echoed to it */
+  size_t low_watermark;  /* resume reading once its queue drained down to this */
+  uint64_t drain_timeout; /* ms to wait for pending echoes on QUIT before closing connections */
+  uint64_t idle_timeout;  /* ms without reads or completed writes before we reap a connection, 0 disables */
+  uint64_t read_timeout;  /* ms without anything read from the client before we reap it, 0 disables */
+  size_t max_frame;       /* longest line we look at for commands, longer ones are only echoed */
+  int udp;                /* also echo UDP datagrams on the same port */
+  int send_copy;          /* SEND goes through uv_fs_read + uv_write instead of uv_fs_sendfile, for comparison */
+} echo_config_t;
+
+static echo_config_t config = {
+    .loops = 0,
+    .buf_size = 64 * 1024,
+    .pool_max = 4096,
+    .high_watermark = 1024 * 1024,
+    .low_watermark = 256 * 1024,
+    .drain_timeout = 5000,
+    .idle_timeout = 60000,
+    .read_timeout = 0,
+    .max_frame = 1024,
+    .udp = 0,
+    .send_copy = 0};
+static echo_loop_t *echo_loops;
+static int num_echo_loops;
+static int quitting; /* set by whichever loop receives QUIT first */
+static uint64_t start_time;
+
+/* counters have a single writer (the owning loop thread) but may be read from any thread */
+#define STAT_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/*
+ * A chunk of data read from a client which we echo back.
+ * Chunks that can't be written right away are queued on the connection and the first chunk of each
+ * batch doubles as the uv_write_t for the whole batch.
+ */
+typedef struct write_req_s
+{
+  uv_write_t req;
+  uv_buf_t buf;
+  char *base; /* start of the pooled read buffer, `buf` may point past it after a partial write */
+  int nbufs;  /* number of chunks in the batch this req heads */
+  struct write_req_s *next;
+} write_req_t;
+
+/*
+ * Receive buffer for one recvmmsg call, the replies point right into it.
+ * Replies are collected while libuv hands us the datagrams and sent with a single sendmmsg once the batch is complete.
+ * It goes back to the pool once the receive is done and every reply was sent.
+ */
+typedef struct udp_batch_s
+{
+  int refs;
+  int datagrams;
+  struct sockaddr_storage addrs[UDP_BATCH];
+  uv_buf_t replies[UDP_BATCH];
+  char data[]; /* UDP_BATCH chunks of UDP_DGRAM_MAX bytes */
+} udp_batch_t;
+
+typedef struct
+{
+  uv_udp_send_t req;
+  udp_batch_t *batch;
+} udp_send_req_t;
+
+enum
+{
+  TRANSFER_QUEUED,  /* waits for the echoes queued ahead of it */
+  TRANSFER_BUSY,    /* a fs request or write is in flight */
+  TRANSFER_POLLING, /* the socket buffer is full, waiting for it to become writable */
+};
+
+/*
+ * A file sent to the client with `SEND <path>`.
+ * With uv_fs_sendfile the kernel copies straight from the page cache into the socket, the data never passes through read_cb
+ * or our buffers. sendfile runs on the threadpool against a dup of the socket, so a connection closing mid transfer can't
+ * make it write into an unrelated fd.
+ */
+typedef struct echo_transfer_s
+{
+  uv_fs_t req;          /* open, fstat, sendfile or read and close, one at a time */
+  uv_write_t write_req; /* --send-mode copy */
+  uv_poll_t poll;       /* waits on `sock` when sendfile returned UV_EAGAIN */
+  echo_conn_t *conn;    /* NULL once the connection closed */
+  echo_loop_t *el;
+  char *path;
+  char *buf; /* --send-mode copy */
+  uv_file file;
+  uv_os_fd_t sock;
+  int state;
+  int polling; /* `poll` is initialized and needs closing */
+  int64_t offset;
+  int64_t size;
+  uint64_t started;
+} echo_transfer_t;
+
+struct echo_conn_s
+{
+  uv_tcp_t tcp; /* first field so we can cast between the connection and its stream */
+  echo_conn_t *prev;
+  echo_conn_t *next;
+  uv_shutdown_t *shutdown_req; /* set once uv_shutdown was called */
+  echo_conn_t *wheel_prev;
+  echo_conn_t *wheel_next;
+  uint64_t wheel_tick; /* tick of the slot we're in, 0 when not on the wheel */
+  uint64_t last_read;   /* uv_now() of the last read */
+  uint64_t last_active; /* uv_now() of the last read or completed write */
+  uint64_t reap_deadline; /* once reaped, when we stop waiting for the shutdown and close */
+  luv_framer_t framer;    /* splits what the client sends into lines so we find commands like QUIT */
+  write_req_t *pending;
+  write_req_t *pending_tail;
+  size_t pending_bytes; /* bytes in `pending`, libuv doesn't know about them yet */
+  int writing;  /* a batch is in flight */
+  int paused;   /* reading is stopped until the write queue drains */
+  int shutdown; /* shut down once all pending chunks are written */
+  int reaped;   /* timed out, shutdown is underway */
+  echo_transfer_t *transfer; /* SEND in progress, reading is stopped until it finishes */
+};
+
+/* forward declarations */
+static void pool_init(pool_t *, size_t, uint64_t);
+static void *pool_get(pool_t *);
+static void pool_put(void *);
+static void pool_destroy(pool_t *);
+
+static void close_cb(uv_handle_t *client);
+static void shutdown_cb(uv_shutdown_t *, int);
+static void echo_conn_close(echo_conn_t *);
+static void echo_conn_shutdown(echo_conn_t *);
+
+static void alloc_cb(uv_handle_t *, size_t, uv_buf_t *);
+static void read_cb(uv_stream_t *, ssize_t, const uv_buf_t *);
+static void write_cb(uv_write_t *, int);
+
+static void echo_drain_all();
+static void transfer_start(echo_transfer_t *);
+static void transfer_detach(echo_transfer_t *);
+
+static void pool_init(pool_t *pool, size_t item_size, uint64_t max_items)
+{
+  memset(pool, 0, sizeof(pool_t));
+  /* round up so every item header stays aligned */
+  pool->item_size = (item_size + sizeof(pool_item_t) - 1) & ~(sizeof(pool_item_t) - 1);
+  pool->max_items = max_items;
+  pool->slab_items = max_items > 0 && max_items < POOL_SLAB_ITEMS ? max_items : POOL_SLAB_ITEMS;
+}
+
+static void pool_grow(pool_t *pool)
+{
+  int i;
+  size_t stride = sizeof(pool_item_t) + pool->item_size;
+  pool_slab_t *slab = malloc(sizeof(pool_slab_t) + stride * pool->slab_items);
+  if (slab == NULL)
+    return;
+
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+
+  for (i = 0; i < pool->slab_items; i++)
+  {
+    pool_item_t *item = (pool_item_t *)((char *)(slab + 1) + i * stride);
+    item->pool = pool;
+    item->next = pool->free;
+    pool->free = item;
+  }
+  pool->capacity += pool->slab_items;
+}
+
+static void *pool_get(pool_t *pool)
+{
+  pool_item_t *item;
+
+  if (pool->free == NULL && pool->capacity < pool->max_items)
+    pool_grow(pool);
+
+  item = pool->free;
+  if (item == NULL)
+  {
+    /* over the high-water mark, hand out a heap object which is freed again on release */
+    STAT_ADD(pool->misses, 1);
+    item = malloc(sizeof(pool_item_t) + pool->item_size);
+    if (item == NULL)
+      return NULL;
+    item->pool = NULL;
+    return item + 1;
+  }
+
+  pool->free = item->next;
+  STAT_ADD(pool->hits, 1);
+  STAT_ADD(pool->in_use, 1);
+  if (pool->in_use > pool->high_water)
+    STAT_ADD(pool->high_water, pool->in_use - pool->high_water);
+  return item + 1;
+}
+
+static void pool_put(void *ptr)
+{
+  pool_item_t *item;
+  pool_t *pool;
+
+  if (ptr == NULL)
+    return;
+
+  item = (pool_item_t *)ptr - 1;
+  pool = item->pool;
+  if (pool == NULL)
+  {
+    free(item);
+    return;
+  }
+
+  item->next = pool->free;
+  pool->free = item;
+  STAT_ADD(pool->in_use, -1);
+}
+
+static void pool_destroy(pool_t *pool)
+{
+  pool_slab_t *slab, *next;
+  for (slab = pool->slabs; slab != NULL; slab = next)
+  {
+    next = slab->next;
+    free(slab);
+  }
+  pool->slabs = NULL;
+  pool->free = NULL;
+  pool->capacity = 0;
+}
+
+static void log_pool_stats(const char *name, pool_t *pool)
+{
+  log_info("  %s pool: %llu hits, %llu misses, %llu high-water, %llu in use",
+           name,
+           (unsigned long long)STAT_GET(pool->hits),
+           (unsigned long long)STAT_GET(pool->misses),
+           (unsigned long long)STAT_GET(pool->high_water),
+           (unsigned long long)STAT_GET(pool->in_use));
+}
+
+static void log_udp_stats(echo_loop_t *el)
+{
+  int n, len = 0;
+  char sizes[UDP_BATCH * 24] = "";
+  uint64_t datagrams = STAT_GET(el->datagrams);
+  double secs = (uv_hrtime() - start_time) / 1e9;
+
+  for (n = 1; n <= UDP_BATCH; n++)
+  {
+    uint64_t count = STAT_GET(el->udp_batch_sizes[n]);
+    if (count)
+      len += snprintf(sizes + len, sizeof(sizes) - len, " %d:%llu", n, (unsigned long long)count);
+  }
+
+  log_info("  udp: %llu datagrams, %.0f datagrams/s, %llu recvmmsg batches, %.1f datagrams per batch, %llu send calls",
+           (unsigned long long)datagrams,
+           datagrams / secs,
+           (unsigned long long)STAT_GET(el->udp_batches),
+           STAT_GET(el->udp_batches) ? (double)datagrams / STAT_GET(el->udp_batches) : 0.0,
+           (unsigned long long)STAT_GET(el->udp_sends));
+  log_info("  udp batch sizes (datagrams:batches):%s", sizes);
+  log_pool_stats("udp batch", &el->udp_pool);
+}
+
+static void log_loop_stats()
+{
+  int i;
+  for (i = 0; i < num_echo_loops; i++)
+  {
+    echo_loop_t *el = &echo_loops[i];
+    uint64_t messages = STAT_GET(el->messages);
+    uint64_t syscalls = STAT_GET(el->try_writes) + STAT_GET(el->writes);
+    log_info("loop %d: %llu connections, %llu bytes read, %llu bytes written",
+             el->id,
+             (unsigned long long)STAT_GET(el->connections),
+             (unsigned long long)STAT_GET(el->bytes_read),
+             (unsigned long long)STAT_GET(el->bytes_written));
+    /* without the fast path and coalescing every message costs one write syscall */
+    log_info("  %llu messages echoed with %llu write syscalls (%llu try, %llu queued, %llu coalesced), %.1f saved per 1000 messages",
+             (unsigned long long)messages,
+             (unsigned long long)syscalls,
+             (unsigned long long)STAT_GET(el->try_writes),
+             (unsigned long long)STAT_GET(el->writes),
+             (unsigned long long)STAT_GET(el->coalesced),
+             messages ? 1000.0 * ((double)messages - syscalls) / messages : 0.0);
+    log_info("  %llu connections paused by backpressure, %llu pauses, %llu reaped after timing out",
+             (unsigned long long)STAT_GET(el->paused),
+             (unsigned long long)STAT_GET(el->pauses),
+             (unsigned long long)STAT_GET(el->reaps));
+    if (STAT_GET(el->transfers))
+    {
+      log_info("  %llu files sent, sendfile %llu bytes at %.1f MB/s, read+write %llu bytes at %.1f MB/s",
+               (unsigned long long)STAT_GET(el->transfers),
+               (unsigned long long)STAT_GET(el->sendfile_bytes),
+               STAT_GET(el->sendfile_ns) ? STAT_GET(el->sendfile_bytes) / (STAT_GET(el->sendfile_ns) / 1e9) / (1024 * 1024) : 0.0,
+               (unsigned long long)STAT_GET(el->copy_bytes),
+               STAT_GET(el->copy_ns) ? STAT_GET(el->copy_bytes) / (STAT_GET(el->copy_ns) / 1e9) / (1024 * 1024) : 0.0);
+    }
+    log_pool_stats("buffer", &el->buf_pool);
+    log_pool_stats("write request", &el->req_pool);
+    if (config.udp)
+      log_udp_stats(el);
+  }
+}
+
+static void release_chunk(write_req_t *chunk)
+{
+  pool_put(chunk->base);
+  pool_put(chunk);
+}
+
+static void wheel_insert(timer_wheel_t *wheel, echo_conn_t *conn, uint64_t deadline)
+{
+  uint64_t tick;
+  echo_conn_t **slot;
+
+  /* UINT64_MAX means no timeout applies right now, i.e. a paused connection with only a read timeout */
+  /* rounding that up would overflow into a near slot, so we look at the connection again a rotation later */
+  if (deadline > UINT64_MAX - WHEEL_TICK_MS)
+    tick = wheel->tick + WHEEL_SLOTS;
+  else
+    tick = (deadline + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+
+  if (tick < wheel->tick)
+    tick = wheel->tick;
+  slot = &wheel->slots[tick % WHEEL_SLOTS];
+
+  conn->wheel_tick = tick;
+  conn->wheel_prev = NULL;
+  conn->wheel_next = *slot;
+  if (*slot != NULL)
+    (*slot)->wheel_prev = conn;
+  *slot = conn;
+}
+
+static void wheel_remove(timer_wheel_t *wheel, echo_conn_t *conn)
+{
+  if (conn->wheel_tick == 0)
+    return;
+
+  if (conn->wheel_prev != NULL)
+    conn->wheel_prev->wheel_next = conn->wheel_next;
+  else
+    wheel->slots[conn->wheel_tick % WHEEL_SLOTS] = conn->wheel_next;
+  if (conn->wheel_next != NULL)
+    conn->wheel_next->wheel_prev = conn->wheel_prev;
+  conn->wheel_tick = 0;
+}
+
+/* The earliest of the connection's timeouts, only called when at least one of them is enabled */
+static uint64_t conn_deadline(echo_conn_t *conn)
+{
+  uint64_t deadline = UINT64_MAX;
+
+  if (conn->reaped)
+    return conn->reap_deadline;
+  if (config.idle_timeout)
+    deadline = conn->last_active + config.idle_timeout;
+  /* a paused connection isn't read from by our choice, the idle timeout still covers it */
+  if (config.read_timeout && !conn->paused && conn->last_read + config.read_timeout < deadline)
+    deadline = conn->last_read + config.read_timeout;
+  return deadline;
+}
+
+/* Shuts a timed out connection down, if that doesn't complete within another timeout we close it */
+static void echo_conn_reap(echo_conn_t *conn, uint64_t now)
+{
+  echo_loop_t *el = conn->tcp.loop->data;
+  uint64_t grace = config.idle_timeout > config.read_timeout ? config.idle_timeout : config.read_timeout;
+
+  if (conn->reaped)
+  {
+    echo_conn_close(conn);
+    return;
+  }
+
+  log_info("loop %d: reaping idle connection", el->id);
+  STAT_ADD(el->reaps, 1);
+  conn->reaped = 1;
+  conn->reap_deadline = now + grace;
+  wheel_insert(&el->wheel, conn, conn->reap_deadline);
+
+  // http://docs.libuv.org/en/latest/stream.html#c.uv_read_stop
+  uv_read_stop((uv_stream_t *)conn);
+  echo_conn_shutdown(conn);
+}
+
+static void wheel_tick_cb(uv_timer_t *timer)
+{
+  echo_loop_t *el = timer->loop->data;
+  timer_wheel_t *wheel = &el->wheel;
+  uint64_t now = uv_now(timer->loop);
+  echo_conn_t *conn, *next;
+
+  /* the timer may fire late, catch up on every tick we missed */
+  for (; wheel->tick <= now / WHEEL_TICK_MS; wheel->tick++)
+  {
+    echo_conn_t **slot = &wheel->slots[wheel->tick % WHEEL_SLOTS];
+    conn = *slot;
+    *slot = NULL;
+
+    for (; conn != NULL; conn = next)
+    {
+      uint64_t deadline;
+      next = conn->wheel_next;
+
+      /* due in a later rotation */
+      if (conn->wheel_tick > wheel->tick)
+      {
+        wheel_insert(wheel, conn, conn->wheel_tick * WHEEL_TICK_MS);
+        continue;
+      }
+
+      conn->wheel_tick = 0;
+      if (uv_is_closing((uv_handle_t *)conn))
+        continue;
+
+      deadline = conn_deadline(conn);
+      if (deadline <= now)
+        echo_conn_reap(conn, now);
+      else
+        wheel_insert(wheel, conn, deadline);
+    }
+  }
+}
+
+static void close_cb(uv_handle_t *client)
+{
+  echo_conn_t *conn = (echo_conn_t *)client;
+  echo_loop_t *el = client->loop->data;
+  write_req_t *chunk, *next;
+
+  if (conn->paused)
+    STAT_ADD(el->paused, -1);
+  wheel_remove(&el->wheel, conn);
+  luv_framer_destroy(&conn->framer);
+  if (conn->transfer != NULL)
+    transfer_detach(conn->transfer);
+
+  /* chunks that never made it into a write, i.e. when the connection was closed on error or at the drain deadline */
+  for (chunk = conn->pending; chunk != NULL; chunk = next)
+  {
+    next = chunk->next;
+    release_chunk(chunk);
+  }
+
+  if (conn->prev != NULL)
+    conn->prev->next = conn->next;
+  else if (el->conns == conn)
+    el->conns = conn->next;
+  if (conn->next != NULL)
+    conn->next->prev = conn->prev;
+
+  free(client);
+  log_info("Closed connection");
+
+  /* the last connection of a draining loop is gone, so stop waiting for the deadline and let uv_run return */
+  if (el->draining && el->conns == NULL && !uv_is_closing((uv_handle_t *)&el->drain_timer))
+    uv_close((uv_handle_t *)&el->drain_timer, NULL);
+}
+
+static void echo_conn_close(echo_conn_t *conn)
+{
+  // http://docs.libuv.org/en/latest/handle.html#c.uv_is_closing
+  if (!uv_is_closing((uv_handle_t *)conn))
+    uv_close((uv_handle_t *)conn, close_cb);
+}
+
+static void echo_conn_shutdown(echo_conn_t *conn)
+{
+  int r;
+
+  /* libuv orders the shutdown after writes it already queued, but not after our pending chunks */
+  conn->shutdown = 1;
+  if (conn->pending != NULL || conn->transfer != NULL || conn->shutdown_req != NULL || uv_is_closing((uv_handle_t *)conn))
+    return;
+
+  // http://docs.libuv.org/en/latest/stream.html#c.uv_shutdown
+  conn->shutdown_req = malloc(sizeof(uv_shutdown_t));
+  r = uv_shutdown(conn->shutdown_req, (uv_stream_t *)conn, shutdown_cb);
+  CHECK(r, "uv_shutdown");
+}
+
+/* Hands all pending chunks (up to MAX_NBUFS) to libuv as a single multi-buffer write, i.e. one writev */
+static void echo_flush(echo_conn_t *conn)
+{
+  int r, n;
+  uv_buf_t bufs[MAX_NBUFS];
+  write_req_t *head = conn->pending;
+  write_req_t *chunk = head;
+  write_req_t *last = NULL;
+  echo_loop_t *el = conn->tcp.loop->data;
+
+  for (n = 0; chunk != NULL && n < MAX_NBUFS; n++)
+  {
+    bufs[n] = chunk->buf;
+    conn->pending_bytes -= chunk->buf.len;
+    last = chunk;
+    chunk = chunk->next;
+  }
+
+  conn->pending = chunk;
+  if (chunk == NULL)
+    conn->pending_tail = NULL;
+  last->next = NULL;
+  head->nbufs = n;
+
+  STAT_ADD(el->writes, 1);
+  STAT_ADD(el->coalesced, n - 1);
+  conn->writing = 1;
+  // https://docs.libuv.org/en/latest/stream.html#c.uv_write
+  r = uv_write(&head->req, (uv_stream_t *)conn, bufs, n, write_cb);
+  CHECK(r, "uv_write");
+}
+
+/* Bytes waiting to be echoed to the client, both handed to libuv and still pending with us */
+static size_t echo_conn_queued(echo_conn_t *conn)
+{
+  // http://docs.libuv.org/en/latest/stream.html#c.uv_stream_get_write_queue_size
+  return uv_stream_get_write_queue_size((uv_stream_t *)conn) + conn->pending_bytes;
+}
+
+/* Stops reading from a client that doesn't keep up with its echoes, so its queue can't grow without bound */
+static void echo_conn_pause(echo_conn_t *conn)
+{
+  int r;
+  echo_loop_t *el = conn->tcp.loop->data;
+
+  if (conn->paused || conn->shutdown || echo_conn_queued(conn) <= config.high_watermark)
+    return;
+
+  // http://docs.libuv.org/en/latest/stream.html#c.uv_read_stop
+  r = uv_read_stop((uv_stream_t *)conn);
+  CHECK(r, "uv_read_stop");
+  conn->paused = 1;
+  STAT_ADD(el->paused, 1);
+  STAT_ADD(el->pauses, 1);
+}
+
+static void echo_conn_resume(echo_conn_t *conn)
+{
+  int r;
+  echo_loop_t *el = conn->tcp.loop->data;
+
+  /* a draining loop doesn't read anymore, neither does a connection sending a file */
+  if (!conn->paused || el->draining || conn->transfer != NULL || echo_conn_queued(conn) > config.low_watermark)
+    return;
+
+  // http://docs.libuv.org/en/latest/stream.html#c.uv_read_start
+  r = uv_read_start((uv_stream_t *)conn, alloc_cb, read_cb);
+  CHECK(r, "uv_read_start");
+  conn->paused = 0;
+  conn->last_read = uv_now(conn->tcp.loop);
+  STAT_ADD(el->paused, -1);
+}
+
+/* Echoes a chunk, writing it immediately if nothing is queued ahead of it */
+static void echo_write(echo_conn_t *conn, write_req_t *chunk)
+{
+  int r;
+  echo_loop_t *el = conn->tcp.loop->data;
+
+  STAT_ADD(el->messages, 1);
+
+  if (!conn->writing && conn->pending == NULL)
+  {
+    // http://docs.libuv.org/en/latest/stream.html#c.uv_try_write
+    r = uv_try_write((uv_stream_t *)conn, &chunk->buf, 1);
+    STAT_ADD(el->try_writes, 1);
+    if (r > 0)
+    {
+      STAT_ADD(el->bytes_written, r);
+      conn->last_active = uv_now(conn->tcp.loop);
+      if (r == chunk->buf.len)
+      {
+        release_chunk(chunk);
+        return;
+      }
+      /* only queue the part that didn't fit */
+      chunk->buf.base += r;
+      chunk->buf.len -= r;
+    }
+    else if (r != UV_EAGAIN && r != UV_ENOSYS)
+    {
+      log_error("uv_try_write: [%s(%d): %s]", uv_err_name(r), r, uv_strerror(r));
+      release_chunk(chunk);
+      return;
+    }
+  }
+
+  chunk->next = NULL;
+  if (conn->pending_tail != NULL)
+    conn->pending_tail->next = chunk;
+  else
+    conn->pending = chunk;
+  conn->pending_tail = chunk;
+  conn->pending_bytes += chunk->buf.len;
+
+  /* while a batch is in flight we keep collecting chunks, write_cb sends them all at once */
+  if (!conn->writing)
+    echo_flush(conn);
+
+  echo_conn_pause(conn);
+}
+
+/* Continues with whatever we owe the client next, once nothing of ours is in flight */
+static void echo_conn_next(echo_conn_t *conn)
+{
+  if (conn->writing || uv_is_closing((uv_handle_t *)conn))
+    return;
+
+  if (conn->pending != NULL)
+    echo_flush(conn);
+  else if (conn->transfer != NULL)
+  {
+    if (conn->transfer->state == TRANSFER_QUEUED)
+      transfer_start(conn->transfer);
+  }
+  else if (conn->shutdown)
+    echo_conn_shutdown(conn);
+}
+
+static void shutdown_cb(uv_shutdown_t *req, int status)
+{
+  /* the connection may have been closed already, which cancels the shutdown */
+  // http://docs.libuv.org/en/latest/handle.html#c.uv_close
+  echo_conn_close((echo_conn_t *)req->handle);
+  free(req);
+}
+
+static void onconnection(uv_stream_t *server, int status)
+{
+  CHECK(status, "onconnection");
+
+  int r = 0;
+  echo_loop_t *el = server->loop->data;
+
+  /* 4. Accept client connection */
+  log_info("Accepting Connection on loop %d", el->id);
+
+  /* 4.1. Init client connection using `server->loop`, passing the client handle */
+  // http://docs.libuv.org/en/latest/tcp.html#c.uv_tcp_init
+  echo_conn_t *client = calloc(1, sizeof(echo_conn_t));
+  luv_framer_init(&client->framer, config.max_frame);
+  r = uv_tcp_init(server->loop, &client->tcp);
+  CHECK(r, "uv_tcp_init");
+
+  /* 4.2. Accept the now initialized client connection */
+  // http://docs.libuv.org/en/latest/stream.html#c.uv_accept
+  r = uv_accept(server, (uv_stream_t *)client);
+  if (r)
+  {
+    log_error("trying to accept connection %d", r);
+    /* never connected, so there is nothing to shut down */
+    echo_conn_close(client);
+    return;
+  }
+
+  STAT_ADD(el->connections, 1);
+  client->next = el->conns;
+  if (el->conns != NULL)
+    el->conns->prev = client;
+  el->conns = client;
+
+  client->last_read = client->last_active = uv_now(server->loop);
+  if (config.idle_timeout || config.read_timeout)
+    wheel_insert(&el->wheel, client, conn_deadline(client));
+
+  /* 5. Start reading data from client */
+  // http://docs.libuv.org/en/latest/stream.html#c.uv_read_start
+  r = uv_read_start((uv_stream_t *)client, alloc_cb, read_cb);
+  CHECK(r, "uv_read_start");
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf)
+{
+  /* libuv suggests a buffer size but leaves it up to us to create one of any size we see fit */
+  /* we hand out fixed-size buffers from the loop's pool, they are returned once the echo was written */
+  echo_loop_t *el = handle->loop->data;
+  buf->base = pool_get(&el->buf_pool);
+  buf->len = buf->base == NULL ? 0 : config.buf_size;
+  if (buf->base == NULL)
+  {
+    log_error("alloc_cb buffer didn't properly initialize");
+  }
+}
+
+static void transfer_free(echo_transfer_t *t)
+{
+  if (t->sock >= 0)
+    close(t->sock);
+  pool_put(t->buf);
+  free(t->path);
+  free(t);
+}
+
+static void transfer_poll_close_cb(uv_handle_t *handle)
+{
+  transfer_free(handle->data);
+}
+
+static void transfer_closed_cb(uv_fs_t *req)
+{
+  echo_transfer_t *t = req->data;
+  echo_conn_t *conn = t->conn;
+  echo_loop_t *el = t->el;
+  uint64_t ns = uv_hrtime() - t->started;
+
+  uv_fs_req_cleanup(req);
+
+  STAT_ADD(el->transfers, 1);
+  if (config.send_copy)
+    STAT_ADD(el->copy_ns, ns);
+  else
+    STAT_ADD(el->sendfile_ns, ns);
+  log_info("Sent %s: %lld of %lld bytes in %.3f s with %s",
+           t->path, (long long)t->offset, (long long)t->size, ns / 1e9, config.send_copy ? "read+write" : "sendfile");
+
+  if (t->polling)
+    uv_close((uv_handle_t *)&t->poll, transfer_poll_close_cb);
+  else
+    transfer_free(t);
+
+  if (conn == NULL)
+    return;
+
+  /* pick up reading where SEND left off, unless something else stopped it in the meantime */
+  conn->transfer = NULL;
+  if (!conn->paused && !conn->shutdown && !el->draining)
+  {
+    // http://docs.libuv.org/en/latest/stream.html#c.uv_read_start
+    int r = uv_read_start((uv_stream_t *)conn, alloc_cb, read_cb);
+    CHECK(r, "uv_read_start");
+  }
+  echo_conn_next(conn);
+}
+
+static void transfer_close_file(echo_transfer_t *t)
+{
+  int r;
+
+  t->state = TRANSFER_BUSY;
+  if (t->file < 0)
+  {
+    transfer_closed_cb(&t->req);
+    return;
+  }
+
+  // http://docs.libuv.org/en/latest/fs.html#c.uv_fs_close
+  r = uv_fs_close(t->el->loop, &t->req, t->file, transfer_closed_cb);
+  CHECK(r, "uv_fs_close");
+}
+
+static void transfer_next(echo_transfer_t *t);
+
+static void transfer_poll_cb(uv_poll_t *handle, int status, int events)
+{
+  echo_transfer_t *t = handle->data;
+
+  // http://docs.libuv.org/en/latest/poll.html#c.uv_poll_stop
+  uv_poll_stop(handle);
+  t->state = TRANSFER_BUSY;
+  if (status < 0)
+  {
+    log_error("transfer_poll_cb: [%s(%d): %s]", uv_err_name(status), status, uv_strerror(status));
+    transfer_close_file(t);
+    return;
+  }
+  transfer_next(t);
+}
+
+/* Waits for the socket to become writable again, polling a dup of it as libuv already watches the original fd */
+static void transfer_wait_writable(echo_transfer_t *t)
+{
+  int r;
+
+  if (!t->polling)
+  {
+    // http://docs.libuv.org/en/latest/poll.html#c.uv_poll_init_socket
+    r = uv_poll_init_socket(t->el->loop, &t->poll, t->sock);
+    CHECK(r, "uv_poll_init_socket");
+    t->poll.data = t;
+    t->polling = 1;
+  }
+
+  t->state = TRANSFER_POLLING;
+  // http://docs.libuv.org/en/latest/poll.html#c.uv_poll_start
+  r = uv_poll_start(&t->poll, UV_WRITABLE, transfer_poll_cb);
+  CHECK(r, "uv_poll_start");
+}
+
+static void transfer_sendfile_cb(uv_fs_t *req)
+{
+  echo_transfer_t *t = req->data;
+  ssize_t r = req->result;
+
+  uv_fs_req_cleanup(req);
+
+  if (t->conn == NULL)
+  {
+    transfer_close_file(t);
+    return;
+  }
+
+  /* the socket buffer is full, sendfile on the non-blocking socket wrote nothing */
+  if (r == UV_EAGAIN)
+  {
+    transfer_wait_writable(t);
+    return;
+  }
+
+  if (r <= 0)
+  {
+    if (r < 0)
+      log_error("uv_fs_sendfile: [%s(%d): %s]", uv_err_name(r), (int)r, uv_strerror(r));
+    transfer_close_file(t);
+    return;
+  }
+
+  t->offset += r;
+  STAT_ADD(t->el->sendfile_bytes, r);
+  t->conn->last_active = uv_now(t->el->loop);
+  transfer_next(t);
+}
+
+static void transfer_write_cb(uv_write_t *req, int status)
+{
+  echo_transfer_t *t = req->data;
+
+  if (status < 0 || t->conn == NULL)
+  {
+    transfer_close_file(t);
+    return;
+  }
+
+  t->conn->last_active = uv_now(t->el->loop);
+  transfer_next(t);
+}
+
+static void transfer_read_cb(uv_fs_t *req)
+{
+  int r;
+  echo_transfer_t *t = req->data;
+  ssize_t nread = req->result;
+  uv_buf_t buf;
+
+  uv_fs_req_cleanup(req);
+
+  if (nread <= 0 || t->conn == NULL)
+  {
+    if (nread < 0)
+      log_error("uv_fs_read: [%s(%d): %s]", uv_err_name(nread), (int)nread, uv_strerror(nread));
+    transfer_close_file(t);
+    return;
+  }
+
+  t->offset += nread;
+  STAT_ADD(t->el->copy_bytes, nread);
+  buf = uv_buf_init(t->buf, nread);
+  t->write_req.data = t;
+  // https://docs.libuv.org/en/latest/stream.html#c.uv_write
+  r = uv_write(&t->write_req, (uv_stream_t *)t->conn, &buf, 1, transfer_write_cb);
+  CHECK(r, "uv_write");
+}
+
+/* Sends the next chunk of the file, or closes it once everything was sent */
+static void transfer_next(echo_transfer_t *t)
+{
+  int r;
+  int64_t left = t->size - t->offset;
+  uv_buf_t buf;
+
+  if (t->conn == NULL || left <= 0)
+  {
+    transfer_close_file(t);
+    return;
+  }
+
+  t->state = TRANSFER_BUSY;
+  t->req.data = t;
+  if (config.send_copy)
+  {
+    /* the path SEND replaces: file data comes into a userspace buffer and is written from there */
+    buf = uv_buf_init(t->buf, left < (int64_t)config.buf_size ? left : config.buf_size);
+    // http://docs.libuv.org/en/latest/fs.html#c.uv_fs_read
+    r = uv_fs_read(t->el->loop, &t->req, t->file, &buf, 1, t->offset, transfer_read_cb);
+    CHECK(r, "uv_fs_read");
+  }
+  else
+  {
+    // http://docs.libuv.org/en/latest/fs.html#c.uv_fs_sendfile
+    r = uv_fs_sendfile(t->el->loop, &t->req, t->sock, t->file, t->offset, left < SENDFILE_CHUNK ? left : SENDFILE_CHUNK, transfer_sendfile_cb);
+    CHECK(r, "uv_fs_sendfile");
+  }
+}
+
+static void transfer_fstat_cb(uv_fs_t *req)
+{
+  echo_transfer_t *t = req->data;
+  uv_os_fd_t fd;
 
-/* forward declarations */
-static void close_cb(uv_handle_t *client);
-static void server_close_cb(uv_handle_t *);
-static void shutdown_cb(uv_shutdown_t *, int);
+  if (req->result < 0)
+  {
+    log_error("uv_fs_fstat: [%s(%d): %s]", uv_err_name(req->result), (int)req->result, uv_strerror(req->result));
+    uv_fs_req_cleanup(req);
+    transfer_close_file(t);
+    return;
+  }
+  t->size = req->statbuf.st_size;
+  uv_fs_req_cleanup(req);
 
-static void alloc_cb(uv_handle_t *, size_t, uv_buf_t *);
-static void read_cb(uv_stream_t *, ssize_t, const uv_buf_t *);
-static void write_cb(uv_write_t *, int);
+  if (t->conn == NULL)
+  {
+    transfer_close_file(t);
+    return;
+  }
 
-static void close_cb(uv_handle_t *client)
-{
-  free(client);
-  log_info("Closed connection");
+  if (config.send_copy)
+  {
+    t->buf = pool_get(&t->el->buf_pool);
+  }
+  else if (uv_fileno((uv_handle_t *)t->conn, &fd) || (t->sock = dup(fd)) < 0)
+  {
+    log_error("Couldn't duplicate the socket to sendfile into");
+    transfer_close_file(t);
+    return;
+  }
+  transfer_next(t);
 }
 
-static void shutdown_cb(uv_shutdown_t *req, int status)
+static void transfer_open_cb(uv_fs_t *req)
 {
-  // http://docs.libuv.org/en/latest/handle.html#c.uv_close
-  uv_close((uv_handle_t *)req->handle, close_cb);
-  free(req);
+  int r;
+  echo_transfer_t *t = req->data;
+
+  if (req->result < 0)
+  {
+    log_error("Couldn't open %s: [%s(%d): %s]", t->path, uv_err_name(req->result), (int)req->result, uv_strerror(req->result));
+    uv_fs_req_cleanup(req);
+    transfer_close_file(t);
+    return;
+  }
+  t->file = req->result;
+  uv_fs_req_cleanup(req);
+
+  // http://docs.libuv.org/en/latest/fs.html#c.uv_fs_fstat
+  r = uv_fs_fstat(t->el->loop, &t->req, t->file, transfer_fstat_cb);
+  CHECK(r, "uv_fs_fstat");
 }
 
-static void onconnection(uv_stream_t *server, int status)
+static void transfer_start(echo_transfer_t *t)
 {
-  CHECK(status, "onconnection");
+  int r;
 
-  int r = 0;
-  uv_shutdown_t *shutdown_req;
+  t->state = TRANSFER_BUSY;
+  t->started = uv_hrtime();
+  t->req.data = t;
+  // http://docs.libuv.org/en/latest/fs.html#c.uv_fs_open
+  r = uv_fs_open(t->el->loop, &t->req, t->path, O_RDONLY, 0, transfer_open_cb);
+  CHECK(r, "uv_fs_open");
+}
 
-  /* 4. Accept client connection */
-  log_info("Accepting Connection");
+/* The connection closed mid transfer, the transfer winds itself down and frees itself */
+static void transfer_detach(echo_transfer_t *t)
+{
+  t->conn = NULL;
+  if (t->state == TRANSFER_QUEUED)
+  {
+    transfer_free(t);
+  }
+  else if (t->state == TRANSFER_POLLING)
+  {
+    uv_poll_stop(&t->poll);
+    transfer_close_file(t);
+  }
+}
 
-  /* 4.1. Init client connection using `server->loop`, passing the client handle */
-  // http://docs.libuv.org/en/latest/tcp.html#c.uv_tcp_init
-  uv_tcp_t *client = malloc(sizeof(uv_tcp_t));
-  r = uv_tcp_init(server->loop, client);
-  CHECK(r, "uv_tcp_init");
+/*
+ * Resolves the path of a SEND command.
+ * Without a path we send the magic file the fs exercises read, relative paths are resolved against the learnuv root.
+ * Absolute paths and `..` are refused so clients can't reach files outside of it.
+ */
+static char *transfer_path(const char *arg, size_t len)
+{
+  char *rel;
+  const char *path;
 
-  /* 4.2. Accept the now initialized client connection */
-  // http://docs.libuv.org/en/latest/stream.html#c.uv_accept
-  r = uv_accept(server, (uv_stream_t *)client);
-  if (r)
+  if (len == 0)
+    return strdup(__MAGIC_FILE__);
+
+  rel = strndup(arg, len);
+  if (rel[0] == '/' || strstr(rel, "..") != NULL)
   {
-    log_error("trying to accept connection %d", r);
+    free(rel);
+    return NULL;
+  }
+
+  path = path_join(__ROOT__, rel);
+  free(rel);
+  return (char *)path;
+}
+
+static echo_transfer_t *transfer_new(echo_conn_t *conn, const char *arg, size_t len)
+{
+  echo_transfer_t *t;
+  char *path = transfer_path(arg, len);
 
-    shutdown_req = malloc(sizeof(uv_shutdown_t));
-    r = uv_shutdown(shutdown_req, (uv_stream_t *)client, shutdown_cb);
-    CHECK(r, "uv_shutdown");
+  if (path == NULL)
+  {
+    log_error("SEND: refusing %.*s, only paths inside %s are served", (int)len, arg, __ROOT__);
+    return NULL;
   }
 
-  /* 5. Start reading data from client */
-  // http://docs.libuv.org/en/latest/stream.html#c.uv_read_start
-  r = uv_read_start((uv_stream_t *)client, alloc_cb, read_cb);
-  CHECK(r, "uv_read_start");
+  t = calloc(1, sizeof(echo_transfer_t));
+  t->conn = conn;
+  t->el = conn->tcp.loop->data;
+  t->path = path;
+  t->file = -1;
+  t->sock = -1;
+  t->state = TRANSFER_QUEUED;
+  return t;
 }
 
-static void alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf)
+/* Returns 1 for a QUIT command, which stops the framer, and queues a transfer for `SEND [path]` */
+static int echo_on_line(void *data, const char *line, size_t len)
 {
-  /* libuv suggests a buffer size but leaves it up to us to create one of any size we see fit */
-  buf->base = malloc(size);
-  buf->len = size;
-  if (buf->base == NULL)
+  echo_conn_t *conn = data;
+
+  if (len == 4 && !strncmp("QUIT", line, 4))
+    return 1;
+
+  if ((len == 4 || (len > 5 && line[4] == ' ')) && !strncmp("SEND", line, 4))
   {
-    log_error("alloc_cb buffer didn't properly initialize");
+    if (conn->transfer != NULL)
+    {
+      log_error("SEND: already sending %s, ignoring %.*s", conn->transfer->path, (int)len, line);
+      return 0;
+    }
+    conn->transfer = transfer_new(conn, line + 5, len > 5 ? len - 5 : 0);
   }
+  return 0;
 }
 
 static void read_cb(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf)
 {
-  int r = 0;
-  uv_shutdown_t *shutdown_req;
+  int quit;
+  echo_conn_t *conn = (echo_conn_t *)client;
+  echo_loop_t *el = client->loop->data;
 
   /* Errors or EOF */
   if (nread < 0)
   {
+    /* i.e. the client reset the connection, which only concerns this connection */
     if (nread != UV_EOF)
     {
-      CHECK(nread, "read_cb");
+      log_error("read_cb: [%s(%d): %s]", uv_err_name(nread), (int)nread, uv_strerror(nread));
+      pool_put(buf->base);
+      echo_conn_close(conn);
+      return;
     }
 
     /* Client signaled that all data has been sent, so we can close the connection and are done */
-    free(buf->base);
+    pool_put(buf->base);
 
-    shutdown_req = malloc(sizeof(uv_shutdown_t));
-    r = uv_shutdown(shutdown_req, client, shutdown_cb);
-    CHECK(r, "uv_shutdown");
+    echo_conn_shutdown((echo_conn_t *)client);
     return;
   }
 
   if (nread == 0)
   {
     /* Everything OK, but nothing read and thus we don't write anything */
-    free(buf->base);
+    pool_put(buf->base);
     return;
   }
 
-  /* Check if we should quit the server which the client signals by sending "QUIT" */
-  if (!strncmp("QUIT", buf->base, fmin(nread, 4)))
+  STAT_ADD(el->bytes_read, nread);
+  ((echo_conn_t *)client)->last_read = ((echo_conn_t *)client)->last_active = uv_now(client->loop);
+
+  /* Check if we should quit the server which the client signals by sending a "QUIT" line */
+  /* The line may be split across reads or share one with other lines, the framer takes care of both */
+  /* A "QUIT" without a newline only counts if it arrived on its own, where it ends an unfinished line doesn't matter */
+  /* i.e. `printf QUIT | nc localhost 7001` or "Hello" and then "QUIT" without any newline, but not "EQUIT" + "Y\n" */
+  quit = luv_framer_feed(&conn->framer, buf->base, nread, echo_on_line, conn) == 1;
+  if (quit || (nread == 4 && !strncmp("QUIT", buf->base, 4)))
   {
     log_info("Closing the server");
-    free(buf->base);
-    /* Before exiting we need to properly close the server via uv_close */
-    /* We can do this synchronously */
-    // http://docs.libuv.org/en/latest/handle.html#c.uv_close
-    uv_close((uv_handle_t *)&tcp_server, NULL);
-    log_info("Closed server, exiting");
-    exit(0);
+    pool_put(buf->base);
+    /* Instead of exiting right away we let every loop finish the echoes it owes and close its connections */
+    /* uv_run then returns on its own and main cleans up */
+    echo_drain_all();
+    return;
   }
 
   /* 6. Write same data back to client since we are an *echo* server and thus can reuse the buffer used to read*/
   /*    We wrap the write req and buf here in order to be able to clean them both later */
-  write_req_t *write_req = malloc(sizeof(write_req_t));
+  write_req_t *write_req = pool_get(&el->req_pool);
   write_req->buf = uv_buf_init(buf->base, nread);
-  // https://docs.libuv.org/en/latest/stream.html#c.uv_write
-  r = uv_write(&write_req->req, client, &write_req->buf, NBUFS, write_cb);
-  CHECK(r, "uv_write");
+  write_req->base = buf->base;
+  echo_write((echo_conn_t *)client, write_req);
+
+  /* A SEND line came in, the file follows the echo of this read */
+  /* We stop reading until it was sent, so nothing else gets echoed in between */
+  if (conn->transfer != NULL && conn->transfer->state == TRANSFER_QUEUED)
+  {
+    // http://docs.libuv.org/en/latest/stream.html#c.uv_read_stop
+    uv_read_stop(client);
+    echo_conn_next(conn);
+  }
 }
 
 static void write_cb(uv_write_t *req, int status)
 {
-  CHECK(status, "write_cb");
-
   log_info("Replied to client");
 
   /* Since the req is the first field inside the wrapper write_req, we can just cast to it */
   /* Basically we are telling C to include a bit more data starting at the same memory location, which in this case is our buf */
+  /* The batch it heads is linked through `next`, each chunk carries its own buffer */
   write_req_t *write_req = (write_req_t *)req;
-  free(write_req->buf.base);
-  free(write_req);
+  write_req_t *next;
+  echo_conn_t *conn = (echo_conn_t *)req->handle;
+  echo_loop_t *el = req->handle->loop->data;
+
+  for (; write_req != NULL; write_req = next)
+  {
+    next = write_req->next;
+    if (status == 0)
+      STAT_ADD(el->bytes_written, write_req->buf.len);
+    release_chunk(write_req);
+  }
+
+  conn->writing = 0;
+
+  /* the client went away or we closed the connection at the drain deadline (UV_ECANCELED) */
+  if (status < 0)
+  {
+    if (status != UV_ECANCELED)
+      log_error("write_cb: [%s(%d): %s]", uv_err_name(status), status, uv_strerror(status));
+    echo_conn_close(conn);
+    return;
+  }
+  conn->last_active = uv_now(req->handle->loop);
+
+  echo_conn_next(conn);
+  echo_conn_resume(conn);
+}
+
+static void udp_batch_put(udp_batch_t *batch)
+{
+  if (--batch->refs == 0)
+    pool_put(batch);
+}
+
+static void udp_alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf)
+{
+  /* with UV_UDP_RECVMMSG libuv reads as many datagrams as fit into the buffer, UDP_DGRAM_MAX bytes each */
+  echo_loop_t *el = handle->loop->data;
+  udp_batch_t *batch = pool_get(&el->udp_pool);
+  el->udp_batch = batch;
+  if (batch == NULL)
+  {
+    log_error("udp_alloc_cb buffer didn't properly initialize");
+    *buf = uv_buf_init(NULL, 0);
+    return;
+  }
+
+  batch->refs = 1; /* held by the receive until libuv is done with the buffer */
+  batch->datagrams = 0;
+  *buf = uv_buf_init(batch->data, UDP_BATCH * UDP_DGRAM_MAX);
+}
+
+static void udp_send_cb(uv_udp_send_t *req, int status)
+{
+  udp_send_req_t *send_req = (udp_send_req_t *)req;
+
+  if (status < 0 && status != UV_ECANCELED)
+    log_error("udp_send_cb: [%s(%d): %s]", uv_err_name(status), status, uv_strerror(status));
+  udp_batch_put(send_req->batch);
+  pool_put(send_req);
+}
+
+/* Sends the replies of a batch with one sendmmsg, whatever doesn't fit into the socket buffer is queued with libuv */
+static void udp_flush(echo_loop_t *el, uv_udp_t *handle, udp_batch_t *batch)
+{
+  int i, r;
+  int sent = 0;
+
+#ifdef __linux__
+  uv_os_fd_t fd;
+  struct mmsghdr msgs[UDP_BATCH];
+
+  /* libuv has no public batched send, it only uses sendmmsg for sends that already queued up */
+  if (uv_fileno((uv_handle_t *)handle, &fd) == 0 && uv_udp_get_send_queue_count(handle) == 0)
+  {
+    memset(msgs, 0, sizeof(struct mmsghdr) * batch->datagrams);
+    for (i = 0; i < batch->datagrams; i++)
+    {
+      msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      msgs[i].msg_hdr.msg_iov = (struct iovec *)&batch->replies[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    do
+      r = sendmmsg(fd, msgs, batch->datagrams, 0);
+    while (r < 0 && errno == EINTR);
+    STAT_ADD(el->udp_sends, 1);
+    if (r > 0)
+      sent = r;
+  }
+#endif
+
+  for (i = sent; i < batch->datagrams; i++)
+  {
+    // http://docs.libuv.org/en/latest/udp.html#c.uv_udp_send
+    udp_send_req_t *send_req = pool_get(&el->udp_req_pool);
+    send_req->batch = batch;
+    batch->refs++;
+    STAT_ADD(el->udp_sends, 1);
+    r = uv_udp_send(&send_req->req, handle, &batch->replies[i], 1, (struct sockaddr *)&batch->addrs[i], udp_send_cb);
+    if (r)
+    {
+      log_error("uv_udp_send: [%s(%d): %s]", uv_err_name(r), r, uv_strerror(r));
+      udp_batch_put(batch);
+      pool_put(send_req);
+    }
+  }
+}
+
+static void udp_recv_cb(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags)
+{
+  echo_loop_t *el = handle->loop->data;
+  udp_batch_t *batch = el->udp_batch;
+
+  if (batch == NULL)
+    return;
+
+  if (nread < 0)
+  {
+    log_error("udp_recv_cb: [%s(%d): %s]", uv_err_name(nread), (int)nread, uv_strerror(nread));
+  }
+  else if (nread > 0 && addr != NULL && batch->datagrams < UDP_BATCH)
+  {
+    /* the reply reuses the chunk the datagram was received into */
+    memcpy(&batch->addrs[batch->datagrams], addr, sizeof(struct sockaddr_in));
+    batch->replies[batch->datagrams] = uv_buf_init(buf->base, nread);
+    batch->datagrams++;
+    STAT_ADD(el->datagrams, 1);
+  }
+
+  /* every datagram of a recvmmsg call is flagged UV_UDP_MMSG_CHUNK, the call without it ends the batch */
+  // http://docs.libuv.org/en/latest/udp.html#c.uv_udp_recv_cb
+  if (flags & UV_UDP_MMSG_CHUNK)
+    return;
+
+  if (batch->datagrams > 0)
+  {
+    STAT_ADD(el->udp_batches, 1);
+    STAT_ADD(el->udp_batch_sizes[batch->datagrams], 1);
+    udp_flush(el, handle, batch);
+  }
+  el->udp_batch = NULL;
+  udp_batch_put(batch);
+}
+
+static void drain_timeout_cb(uv_timer_t *timer)
+{
+  echo_loop_t *el = timer->loop->data;
+  echo_conn_t *conn;
+
+  log_error("loop %d: drain deadline passed, closing remaining connections", el->id);
+  for (conn = el->conns; conn != NULL; conn = conn->next)
+    echo_conn_close(conn);
+}
+
+/* Stops accepting, then shuts every connection down once the echoes it is owed were written */
+static void echo_loop_drain(echo_loop_t *el)
+{
+  int r;
+  echo_conn_t *conn;
+
+  if (el->draining)
+    return;
+  el->draining = 1;
+  log_info("loop %d: draining", el->id);
+
+  // http://docs.libuv.org/en/latest/handle.html#c.uv_close
+  uv_close((uv_handle_t *)&el->tcp_server, NULL);
+  if (config.udp)
+    uv_close((uv_handle_t *)&el->udp_server, NULL);
+  uv_close((uv_handle_t *)&el->drain_async, NULL);
+  /* the drain deadline takes over from the idle timeouts */
+  uv_close((uv_handle_t *)&el->wheel.timer, NULL);
+
+  if (el->conns == NULL)
+  {
+    uv_close((uv_handle_t *)&el->drain_timer, NULL);
+    return;
+  }
+
+  // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_start
+  r = uv_timer_start(&el->drain_timer, drain_timeout_cb, config.drain_timeout, 0);
+  CHECK(r, "uv_timer_start");
+
+  for (conn = el->conns; conn != NULL; conn = conn->next)
+  {
+    if (uv_is_closing((uv_handle_t *)conn))
+      continue;
+    if (!conn->paused)
+    {
+      // http://docs.libuv.org/en/latest/stream.html#c.uv_read_stop
+      r = uv_read_stop((uv_stream_t *)conn);
+      CHECK(r, "uv_read_stop");
+    }
+    echo_conn_shutdown(conn);
+    echo_conn_next(conn);
+  }
+}
+
+static void drain_async_cb(uv_async_t *async)
+{
+  echo_loop_drain(async->loop->data);
+}
+
+/* QUIT may arrive on any loop, each loop drains itself on its own thread */
+static void echo_drain_all()
+{
+  int i;
+
+  if (__atomic_exchange_n(&quitting, 1, __ATOMIC_SEQ_CST))
+    return;
+
+  for (i = 0; i < num_echo_loops; i++)
+  {
+    // http://docs.libuv.org/en/latest/async.html#c.uv_async_send
+    uv_async_send(&echo_loops[i].drain_async);
+  }
+}
+
+/* Lets every loop bind the same port, the kernel then spreads connections and datagrams across them */
+static void set_reuseport(uv_handle_t *handle)
+{
+#ifdef SO_REUSEPORT
+  int r;
+  uv_os_fd_t fd;
+  int on = 1;
+
+  // http://docs.libuv.org/en/latest/handle.html#c.uv_fileno
+  r = uv_fileno(handle, &fd);
+  CHECK(r, "uv_fileno");
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+  {
+    CHECK(uv_translate_sys_error(errno), "setsockopt(SO_REUSEPORT)");
+  }
+#else
+  log_error("SO_REUSEPORT is not supported on this platform");
+  exit(1);
+#endif
+}
+
+static void echo_loop_listen_udp(echo_loop_t *el, int reuseport, const struct sockaddr_in *addr)
+{
+  int r;
+
+  /* UV_UDP_RECVMMSG lets a single wakeup read up to UDP_BATCH datagrams with one recvmmsg call */
+  // http://docs.libuv.org/en/latest/udp.html#c.uv_udp_init_ex
+  r = uv_udp_init_ex(el->loop, &el->udp_server, AF_INET | UV_UDP_RECVMMSG);
+  CHECK(r, "uv_udp_init_ex");
+
+  if (reuseport)
+    set_reuseport((uv_handle_t *)&el->udp_server);
+
+  // http://docs.libuv.org/en/latest/udp.html#c.uv_udp_bind
+  r = uv_udp_bind(&el->udp_server, (const struct sockaddr *)addr, 0);
+  CHECK(r, "uv_udp_bind");
+
+  // http://docs.libuv.org/en/latest/udp.html#c.uv_udp_recv_start
+  r = uv_udp_recv_start(&el->udp_server, udp_alloc_cb, udp_recv_cb);
+  CHECK(r, "uv_udp_recv_start");
 }
 
-int main()
+static void echo_loop_listen(echo_loop_t *el, int reuseport)
 {
   int r = 0;
-  uv_loop_t *loop = uv_default_loop();
 
   // http://docs.libuv.org/en/latest/tcp.html
 
   /* 1. Initialize TCP server */
-  // http://docs.libuv.org/en/latest/tcp.html#c.uv_tcp_init
-  r = uv_tcp_init(loop, &tcp_server);
-  CHECK(r, "uv_tcp_init");
+  /*    uv_tcp_init_ex creates the socket right away, which lets us set SO_REUSEPORT before binding */
+  // http://docs.libuv.org/en/latest/tcp.html#c.uv_tcp_init_ex
+  r = uv_tcp_init_ex(el->loop, &el->tcp_server, AF_INET);
+  CHECK(r, "uv_tcp_init_ex");
+
+  if (reuseport)
+    set_reuseport((uv_handle_t *)&el->tcp_server);
 
   /* 2. Bind to localhost:7001 */
   // http://docs.libuv.org/en/latest/misc.html#c.uv_ip4_addr
@@ -162,8 +1519,11 @@ int main()
   r = uv_ip4_addr(HOST, PORT, &addr);
   CHECK(r, "uv_ip4_addr");
 
+  if (config.udp)
+    echo_loop_listen_udp(el, reuseport, &addr);
+
   // http://docs.libuv.org/en/latest/tcp.html#c.uv_tcp_bind
-  r = uv_tcp_bind(&tcp_server, (struct sockaddr *)&addr, AF_INET);
+  r = uv_tcp_bind(&el->tcp_server, (struct sockaddr *)&addr, AF_INET);
   CHECK(r, "uv_tcp_bind");
 
   /* 3. Start listening */
@@ -172,8 +1532,167 @@ int main()
   // http://docs.libuv.org/en/latest/stream.html
   // http://docs.libuv.org/en/latest/handle.html
   // https://docs.libuv.org/en/latest/stream.html#c.uv_listen
-  r = uv_listen((uv_stream_t *)&tcp_server, SOMAXCONN, onconnection);
+  r = uv_listen((uv_stream_t *)&el->tcp_server, SOMAXCONN, onconnection);
   CHECK(r, "uv_listen");
+}
+
+static void echo_loop_init(echo_loop_t *el)
+{
+  int r;
+
+  pool_init(&el->buf_pool, config.buf_size, config.pool_max);
+  pool_init(&el->req_pool, sizeof(write_req_t), config.pool_max);
+  pool_init(&el->udp_pool, sizeof(udp_batch_t) + UDP_BATCH * UDP_DGRAM_MAX, UDP_POOL_MAX);
+  pool_init(&el->udp_req_pool, sizeof(udp_send_req_t), config.pool_max);
+
+  // http://docs.libuv.org/en/latest/async.html#c.uv_async_init
+  r = uv_async_init(el->loop, &el->drain_async, drain_async_cb);
+  CHECK(r, "uv_async_init");
+  // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_init
+  r = uv_timer_init(el->loop, &el->drain_timer);
+  CHECK(r, "uv_timer_init");
+
+  r = uv_timer_init(el->loop, &el->wheel.timer);
+  CHECK(r, "uv_timer_init");
+  el->wheel.tick = uv_now(el->loop) / WHEEL_TICK_MS;
+  if (config.idle_timeout || config.read_timeout)
+  {
+    // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_start
+    r = uv_timer_start(&el->wheel.timer, wheel_tick_cb, WHEEL_TICK_MS, WHEEL_TICK_MS);
+    CHECK(r, "uv_timer_start");
+  }
+}
+
+static void echo_loop_run(void *arg)
+{
+  echo_loop_t *el = arg;
+  uv_run(el->loop, UV_RUN_DEFAULT);
+}
+
+/* `--loops auto` runs one loop per CPU */
+static int cpu_count()
+{
+  int r, count;
+  uv_cpu_info_t *cpus;
+
+  // http://docs.libuv.org/en/latest/misc.html#c.uv_cpu_info
+  r = uv_cpu_info(&cpus, &count);
+  CHECK(r, "uv_cpu_info");
+  uv_free_cpu_info(cpus, count);
+  return count;
+}
+
+static void parse_args(int argc, char **argv)
+{
+  int i;
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--loops") && i + 1 < argc)
+    {
+      i++;
+      if (strcmp(argv[i], "auto"))
+        config.loops = atoi(argv[i]);
+      else
+        config.loops = cpu_count() > MAX_LOOPS ? MAX_LOOPS : cpu_count();
+    }
+    else if (!strcmp(argv[i], "--buf-size") && i + 1 < argc)
+    {
+      config.buf_size = strtoul(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--pool-max") && i + 1 < argc)
+    {
+      config.pool_max = strtoull(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--high-watermark") && i + 1 < argc)
+    {
+      config.high_watermark = strtoul(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--low-watermark") && i + 1 < argc)
+    {
+      config.low_watermark = strtoul(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--drain-timeout") && i + 1 < argc)
+    {
+      config.drain_timeout = strtoull(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--idle-timeout") && i + 1 < argc)
+    {
+      config.idle_timeout = strtoull(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--read-timeout") && i + 1 < argc)
+    {
+      config.read_timeout = strtoull(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--max-frame") && i + 1 < argc)
+    {
+      config.max_frame = strtoul(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--udp"))
+    {
+      config.udp = 1;
+    }
+    else if (!strcmp(argv[i], "--send-mode") && i + 1 < argc)
+    {
+      config.send_copy = !strcmp(argv[++i], "copy");
+    }
+    else
+    {
+      log_error("Usage: %s [--loops N|auto] [--buf-size BYTES] [--pool-max N] "
+                "[--high-watermark BYTES] [--low-watermark BYTES] [--drain-timeout MS] "
+                "[--idle-timeout MS] [--read-timeout MS] [--max-frame BYTES] [--udp] "
+                "[--send-mode sendfile|copy]",
+                argv[0]);
+      exit(1);
+    }
+  }
+
+  if (config.low_watermark > config.high_watermark)
+  {
+    log_error("--low-watermark must not exceed --high-watermark");
+    exit(1);
+  }
+  if (config.loops > MAX_LOOPS)
+  {
+    log_error("--loops must not exceed %d", MAX_LOOPS);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int r = 0;
+  int i;
+
+  parse_args(argc, argv);
+  start_time = uv_hrtime();
+
+  if (config.loops < 1)
+  {
+    /* classic mode: a single server on the default loop */
+    num_echo_loops = 1;
+    echo_loops = calloc(1, sizeof(echo_loop_t));
+    echo_loops[0].loop = uv_default_loop();
+    echo_loops[0].loop->data = &echo_loops[0];
+    echo_loop_init(&echo_loops[0]);
+    echo_loop_listen(&echo_loops[0], 0);
+  }
+  else
+  {
+    num_echo_loops = config.loops;
+    echo_loops = calloc(num_echo_loops, sizeof(echo_loop_t));
+    for (i = 0; i < num_echo_loops; i++)
+    {
+      echo_loop_t *el = &echo_loops[i];
+      el->id = i;
+      el->loop = malloc(sizeof(uv_loop_t));
+      // http://docs.libuv.org/en/latest/loop.html#c.uv_loop_init
+      r = uv_loop_init(el->loop);
+      CHECK(r, "uv_loop_init");
+      el->loop->data = el;
+      echo_loop_init(el);
+      echo_loop_listen(el, 1);
+    }
+  }
 
   /*
   * Use `nc localhost 7001` to test your server (finish via Ctrl-D) and/or stop the server by sending QUIT.
@@ -183,9 +1702,38 @@ echo 'Hello, Netcat!' | nc localhost 7001
   * You can also send entire files, i.e. `cat package.json | netcat localhost 7001`.
 cat package.json | netcat localhost 7001
   */
-  log_info("Listening on %s:%d", HOST, PORT);
+  log_info("Listening on %s:%d with %d loop(s)", HOST, PORT, num_echo_loops);
+
+  if (config.loops < 1)
+  {
+    uv_run(echo_loops[0].loop, UV_RUN_DEFAULT);
+  }
+  else
+  {
+    // http://docs.libuv.org/en/latest/threading.html#c.uv_thread_create
+    for (i = 0; i < num_echo_loops; i++)
+    {
+      r = uv_thread_create(&echo_loops[i].thread, echo_loop_run, &echo_loops[i]);
+      CHECK(r, "uv_thread_create");
+    }
+    for (i = 0; i < num_echo_loops; i++)
+    {
+      uv_thread_join(&echo_loops[i].thread);
+      uv_loop_close(echo_loops[i].loop);
+      free(echo_loops[i].loop);
+    }
+  }
 
-  uv_run(loop, UV_RUN_DEFAULT);
+  log_info("Closed server, exiting");
+  log_loop_stats();
+  for (i = 0; i < num_echo_loops; i++)
+  {
+    pool_destroy(&echo_loops[i].buf_pool);
+    pool_destroy(&echo_loops[i].req_pool);
+    pool_destroy(&echo_loops[i].udp_pool);
+    pool_destroy(&echo_loops[i].udp_req_pool);
+  }
+  free(echo_loops);
 
   MAKE_VALGRIND_HAPPY();
 
@@ -1,6 +1,7 @@
 #define _BSD_SOURCE
 
 #include "learnuv.h"
+#include "luv_rand.h"
 #include <ncurses.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,18 +13,44 @@
 #define TRACKS 5        // 5
 #define THREADS "5"     // 5
 
+/*
+ * Event driven mode, `08_horse_race --horses N`.
+ * Instead of a thread sleeping for each horse, every horse is a small record with the time of its next step and all of
+ * them are driven from one uv_timer_t on the loop. Horses wait in a wheel of SIM_SLOTS slots of SIM_SLOT_US each,
+ * which has to cover the longest time between two steps (1s / 5).
+ */
+#define SIM_SLOT_US 1000
+#define SIM_SLOTS 256
+#define SIM_PODIUM 10 /* big races only log the first few places */
+
 // http://tldp.org/HOWTO/NCURSES-Programming-HOWTO
 // http://www.gnu.org/software/ncurses/ncurses.html
 #define DRAW 0 // curses isn't working for me. Set to 0 to see log output.
 
+/*
+ * Positions a horse reached, pushed by the worker running its race_cb and drained by the loop.
+ * There is one producer and one consumer, only the worker moves `head` and only the loop moves `tail`, so publishing
+ * the indexes with release stores and reading them with acquire loads is all the synchronization it needs.
+ */
+#define PROGRESS_RING 128 /* power of two, a whole race fits so a worker never has to wait for the loop */
+
+typedef struct
+{
+  int positions[PROGRESS_RING];
+  unsigned int head; /* next slot the worker writes */
+  unsigned int tail; /* next slot the loop reads */
+} progress_ring_t;
+
 typedef struct
 {
-  uv_async_t async;
+  progress_ring_t progress;
   char *name;
   int color;
   int track;
   int speed;
-  int position;
+  int position; /* only touched by the loop, the worker keeps its own */
+  luv_rand_t rng; /* only touched by the worker */
+  uint64_t finish; /* us of simulated time the race took, only with --virtual */
 } horse_t;
 
 const static char *horse_pic[HORSE_HEIGHT] = {
@@ -48,6 +75,41 @@ static horse_t horses[TRACKS] = {
 
 int placement = 1;
 
+/* a horse draws its speeds from its own generator, seeded with `seed` and its track or id, so threads don't share one */
+static uint64_t seed;
+
+/* with --virtual the sleeps of a horse only add up to its simulated time, the race is as fast as the CPU allows */
+static int virtual_clock;
+static int horses_finished;
+
+/* wakes the loop up to drain the progress of all horses, sends that come in while it is pending are merged */
+static uv_async_t progress_async;
+
+typedef struct sim_horse_s
+{
+  struct sim_horse_s *next; /* in the wheel slot */
+  uint64_t due;             /* us since the start of the race */
+  double speed;
+  int position;
+  int id;
+  luv_rand_t rng;
+} sim_horse_t;
+
+typedef struct
+{
+  sim_horse_t *horses;
+  int num_horses;
+  int finished;
+  sim_horse_t *slots[SIM_SLOTS];
+  uint64_t tick; /* next slot to process, in SIM_SLOT_US since the start */
+  uint64_t start;
+  uint64_t steps;
+  sim_horse_t **finishers; /* of the slot being processed */
+  uv_timer_t timer;
+} sim_race_t;
+
+static sim_race_t sim;
+
 static void load_color_palette()
 {
   if (!has_colors())
@@ -91,11 +153,40 @@ void draw_horse(horse_t *horse)
   refresh();
 }
 
+static void progress_push(progress_ring_t *ring, int position)
+{
+  unsigned int head = ring->head;
+
+  /* only if the loop fell a whole ring behind */
+  while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == PROGRESS_RING)
+    usleep(1000);
+
+  ring->positions[head % PROGRESS_RING] = position;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* draws every position the horse reached since we last looked, in order */
+static void progress_drain(horse_t *horse)
+{
+  progress_ring_t *ring = &horse->progress;
+  unsigned int tail = ring->tail;
+  unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+  for (; tail != head; tail++)
+  {
+    horse->position = ring->positions[tail % PROGRESS_RING];
+    draw_horse(horse);
+  }
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
 void progress_cb(uv_async_t *async)
 {
-  horse_t *horse = async->data;
-  draw_horse(horse);
-  return;
+  int i;
+  for (i = 0; i < TRACKS; i++)
+  {
+    progress_drain(&horses[i]);
+  }
 }
 
 void race_cb(uv_work_t *work_req)
@@ -103,18 +194,24 @@ void race_cb(uv_work_t *work_req)
   int r = 0;
   horse_t *horse = work_req->data;
   double speed = 10;
+  int position = 0;
   int i;
+  uint32_t changes[TRACK_WIDTH];
+
+  /* all speed changes of the race at once, the same numbers one luv_rand_below per step would give */
+  luv_rand_fill(&horse->rng, changes, TRACK_WIDTH, 5);
 
   for (i = 0; i < TRACK_WIDTH; i++)
   {
-    horse->position++;
+    position++;
 
     /* 3. Send progress report so we can redraw the position of the horse every time its position changed */
+    progress_push(&horse->progress, position);
     // http://docs.libuv.org/en/latest/async.html#c.uv_async_send
-    r = uv_async_send(&horse->async);
+    r = uv_async_send(&progress_async);
     CHECK(r, "uv_async_send");
 
-    speed += ((rand() % 5) - 2);
+    speed += ((int)changes[i] - 2);
 
     /* whiplash in case our horse starts slowing down too much */
     if (speed < 5)
@@ -122,15 +219,19 @@ void race_cb(uv_work_t *work_req)
       speed = 7;
     }
 
-    usleep(1E6 / speed);
+    if (virtual_clock)
+    {
+      horse->finish += (useconds_t)(1E6 / speed);
+    }
+    else
+    {
+      usleep(1E6 / speed);
+    }
   }
 }
 
-void finished_race_cb(uv_work_t *work_req, int status)
+static void place_horse(horse_t *horse)
 {
-  CHECK(status, "finished_race_cb");
-  horse_t *horse = work_req->data;
-
   if (!DRAW)
   {
     log_info("Horse %s finished in place %d\ttrack: %d", horse->name, placement, horse->track);
@@ -138,9 +239,52 @@ void finished_race_cb(uv_work_t *work_req, int status)
   log_report("Horse %s finished in place %d", horse->name, placement);
 
   placement++;
+}
+
+static int compare_finish(const void *a, const void *b)
+{
+  const horse_t *ha = *(const horse_t **)a;
+  const horse_t *hb = *(const horse_t **)b;
+  if (ha->finish != hb->finish)
+    return ha->finish < hb->finish ? -1 : 1;
+  return ha->track - hb->track;
+}
+
+void finished_race_cb(uv_work_t *work_req, int status)
+{
+  int i;
+  horse_t *order[TRACKS];
+  CHECK(status, "finished_race_cb");
+  horse_t *horse = work_req->data;
+
+  /* the last steps may have been pushed after the async callback ran */
+  progress_drain(horse);
+  free(work_req);
+  horses_finished++;
+
+  if (!virtual_clock)
+  {
+    place_horse(horse);
+  }
+  else if (horses_finished == TRACKS)
+  {
+    /* workers finish in whatever order they get scheduled, the simulated time decides the race */
+    for (i = 0; i < TRACKS; i++)
+    {
+      order[i] = &horses[i];
+    }
+    qsort(order, TRACKS, sizeof(horse_t *), compare_finish);
+    for (i = 0; i < TRACKS; i++)
+    {
+      place_horse(order[i]);
+    }
+  }
 
   // https://docs.libuv.org/en/latest/handle.html#c.uv_close
-  uv_close((uv_handle_t *)&horse->async, NULL);
+  if (horses_finished == TRACKS)
+  {
+    uv_close((uv_handle_t *)&progress_async, NULL);
+  }
 }
 
 void add_horse(uv_loop_t *loop, int track)
@@ -151,17 +295,12 @@ void add_horse(uv_loop_t *loop, int track)
   uv_work_t *work_req = malloc(sizeof(uv_work_t));
 
   work_req->data = horse;
-  horse->async.data = horse;
-
-  /* 1. Init async worker (attached to our horse) passing a callback to report progress */
-  // http://docs.libuv.org/en/latest/async.html#c.uv_async_init
-  r = uv_async_init(loop, &horse->async, progress_cb);
-  CHECK(r, "uv_async_init");
+  luv_rand_seed(&horse->rng, seed, track);
 
   /* 2. Queue work for our worker passing the right callbacks */
   // http://docs.libuv.org/en/latest/threadpool.html#c.uv_queue_work
   r = uv_queue_work(loop, (uv_work_t *)work_req, race_cb, finished_race_cb);
-  CHECK(r, "uv_async_init");
+  CHECK(r, "uv_queue_work");
 
   if (!DRAW)
   {
@@ -169,14 +308,177 @@ void add_horse(uv_loop_t *loop, int track)
   }
 }
 
-int main(void)
+static void sim_insert(sim_horse_t *horse)
+{
+  sim_horse_t **slot = &sim.slots[(horse->due / SIM_SLOT_US) % SIM_SLOTS];
+  horse->next = *slot;
+  *slot = horse;
+}
+
+/* horses on one of the TRACKS get drawn just like in the threaded race */
+static void sim_draw(sim_horse_t *horse)
+{
+  horse_t *shown;
+  if (horse->id >= TRACKS)
+    return;
+  shown = &horses[horse->id];
+  shown->position = horse->position;
+  draw_horse(shown);
+}
+
+/* same as an iteration of race_cb, with the sleep turned into the time of the next step */
+static void sim_step(sim_horse_t *horse)
+{
+  horse->position++;
+  sim_draw(horse);
+  sim.steps++;
+
+  horse->speed += ((int)luv_rand_below(&horse->rng, 5) - 2);
+  if (horse->speed < 5)
+  {
+    horse->speed = 7;
+  }
+  horse->due += 1E6 / horse->speed;
+}
+
+static int sim_compare_finish(const void *a, const void *b)
+{
+  const sim_horse_t *ha = *(const sim_horse_t **)a;
+  const sim_horse_t *hb = *(const sim_horse_t **)b;
+  if (ha->due != hb->due)
+    return ha->due < hb->due ? -1 : 1;
+  return ha->id - hb->id;
+}
+
+/* same as finished_race_cb, big races only log the podium and the named horses */
+static void sim_finish(sim_horse_t *horse)
+{
+  if (placement <= SIM_PODIUM || horse->id < TRACKS || sim.num_horses <= SIM_PODIUM)
+  {
+    const char *name = horse->id < TRACKS ? horses[horse->id].name : "unnamed     ";
+    if (!DRAW)
+    {
+      log_info("Horse %s (%d) finished in place %d at %.3f s", name, horse->id, placement, horse->due / 1E6);
+    }
+    log_report("Horse %s finished in place %d", name, placement);
+  }
+
+  placement++;
+  sim.finished++;
+}
+
+/*
+ * Processes the slots up to now. A horse takes all steps that fall into the slot, the ones that finish in it are
+ * placed by the time they finished, the others go back into the slot of their next step.
+ */
+static void sim_timer_cb(uv_timer_t *timer)
+{
+  int i, num_finishers;
+  /* a virtual clock is always past the end of the race, so one call runs all of it */
+  uint64_t now = virtual_clock ? UINT64_MAX : (uv_hrtime() - sim.start) / 1000;
+  sim_horse_t *horse, *next;
+
+  for (; sim.tick <= now / SIM_SLOT_US && sim.finished < sim.num_horses; sim.tick++)
+  {
+    uint64_t slot_end = (sim.tick + 1) * SIM_SLOT_US;
+    horse = sim.slots[sim.tick % SIM_SLOTS];
+    sim.slots[sim.tick % SIM_SLOTS] = NULL;
+    num_finishers = 0;
+
+    for (; horse != NULL; horse = next)
+    {
+      next = horse->next;
+      while (horse->due < slot_end && horse->position < TRACK_WIDTH)
+        sim_step(horse);
+
+      /* the last step is followed by a sleep as well, the horse is done once that is over */
+      if (horse->position == TRACK_WIDTH && horse->due < slot_end)
+        sim.finishers[num_finishers++] = horse;
+      else
+        sim_insert(horse);
+    }
+
+    qsort(sim.finishers, num_finishers, sizeof(sim_horse_t *), sim_compare_finish);
+    for (i = 0; i < num_finishers; i++)
+      sim_finish(sim.finishers[i]);
+  }
+
+  if (sim.finished == sim.num_horses)
+  {
+    double secs = (uv_hrtime() - sim.start) / 1E9;
+    log_info("%d horses took %llu steps in %.2f s, %.0f steps/s", sim.num_horses, (unsigned long long)sim.steps, secs,
+             sim.steps / secs);
+    uv_timer_stop(timer);
+    uv_close((uv_handle_t *)timer, NULL);
+  }
+}
+
+static void sim_race(uv_loop_t *loop, int num_horses)
+{
+  int i, r;
+
+  sim.num_horses = num_horses;
+  sim.horses = calloc(num_horses, sizeof(sim_horse_t));
+  sim.finishers = malloc(num_horses * sizeof(sim_horse_t *));
+
+  /* everyone starts with their first step right away, like the threads do */
+  for (i = 0; i < num_horses; i++)
+  {
+    sim.horses[i].id = i;
+    sim.horses[i].speed = 10;
+    luv_rand_seed(&sim.horses[i].rng, seed, i);
+    sim_insert(&sim.horses[i]);
+  }
+
+  if (!DRAW)
+  {
+    log_info("Queued %d horses", num_horses);
+  }
+
+  sim.start = uv_hrtime();
+  // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_start
+  r = uv_timer_init(loop, &sim.timer);
+  CHECK(r, "uv_timer_init");
+  r = uv_timer_start(&sim.timer, sim_timer_cb, 0, SIM_SLOT_US / 1000);
+  CHECK(r, "uv_timer_start");
+}
+
+int main(int argc, char **argv)
 {
   int i;
+  int num_horses = 0;
+
+  seed = time(NULL);
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--horses") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+    {
+      num_horses = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+    {
+      seed = strtoull(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--virtual"))
+    {
+      virtual_clock = 1;
+    }
+    else
+    {
+      log_error("Usage: %s [--horses N] [--seed N] [--virtual], races N horses driven by the loop instead of a thread "
+                "per horse, the same seed runs the same race, a virtual clock runs it without waiting",
+                argv[0]);
+      return 1;
+    }
+  }
 
   /* Ensure that each horse gets its own thread, the default libuv threadpool size is 4 */
   setenv("UV_THREADPOOL_SIZE", THREADS, 1);
 
-  srand(time(NULL));
+  if (!DRAW)
+  {
+    log_info("Racing with seed %llu", (unsigned long long)seed);
+  }
 
   uv_loop_t *loop = uv_default_loop();
 
@@ -185,9 +487,21 @@ int main(void)
     init_screen();
   }
 
-  for (i = 0; i < TRACKS; i++)
+  if (num_horses)
+  {
+    sim_race(loop, num_horses);
+  }
+  else
   {
-    add_horse(loop, i);
+    /* 1. Init the async handle all horses report their progress through */
+    // http://docs.libuv.org/en/latest/async.html#c.uv_async_init
+    int r = uv_async_init(loop, &progress_async, progress_cb);
+    CHECK(r, "uv_async_init");
+
+    for (i = 0; i < TRACKS; i++)
+    {
+      add_horse(loop, i);
+    }
   }
 
   uv_run(loop, UV_RUN_DEFAULT);
@@ -0,0 +1,318 @@
+#include "learnuv.h"
+#include "luv_hist.h"
+
+/*
+ * Load generator for 07_tcp_echo_server.
+ * Opens N connections, keeps M messages in flight on each and measures the round trip of every message.
+ *
+ *   echo_bench --connections 64 --pipeline 16 --size 128 --duration 10
+ *   echo_bench --connections 64 --pipeline 16 --size 128 --count 100000
+ */
+
+const static char *HOST = "127.0.0.1";
+const static int PORT = 7001;
+
+typedef struct
+{
+  char *host;
+  int port;
+  int connections;
+  int pipeline;      /* messages in flight per connection */
+  size_t size;       /* bytes per message, the last one is a newline */
+  uint64_t count;    /* messages per connection in fixed-count mode */
+  uint64_t duration; /* seconds to run in fixed-duration mode, takes precedence over count */
+} bench_config_t;
+
+typedef struct
+{
+  uv_tcp_t tcp; /* first field so we can cast between the connection and its stream */
+  uv_connect_t connect_req;
+  uint64_t *sent_at; /* ring of send timestamps, one per message in flight */
+  int head;
+  int in_flight;
+  uint64_t sent;
+  uint64_t received;
+  size_t partial; /* bytes of the oldest in-flight message we already got back */
+} bench_conn_t;
+
+static bench_config_t config = {
+    .port = 0,
+    .connections = 16,
+    .pipeline = 1,
+    .size = 64,
+    .count = 10000,
+    .duration = 0};
+
+static luv_hist_t hist; /* round trips in nanoseconds */
+static char *payload;
+static bench_conn_t *conns;
+static int conns_open;
+static int stopping; /* fixed-duration mode ran out of time, no new messages are sent */
+static uint64_t start_time;
+static uint64_t end_time;
+static uint64_t bytes_received;
+static uv_timer_t duration_timer;
+
+/* forward declarations */
+static void alloc_cb(uv_handle_t *, size_t, uv_buf_t *);
+static void read_cb(uv_stream_t *, ssize_t, const uv_buf_t *);
+static void write_cb(uv_write_t *, int);
+
+static void close_cb(uv_handle_t *handle)
+{
+  if (--conns_open == 0)
+  {
+    end_time = uv_hrtime();
+    uv_close((uv_handle_t *)&duration_timer, NULL);
+  }
+}
+
+static int conn_done(bench_conn_t *conn)
+{
+  return stopping || (!config.duration && conn->sent == config.count);
+}
+
+static void conn_send(bench_conn_t *conn)
+{
+  int r;
+  uv_buf_t buf = uv_buf_init(payload, config.size);
+  uv_write_t *req = malloc(sizeof(uv_write_t));
+
+  conn->sent_at[(conn->head + conn->in_flight) % config.pipeline] = uv_hrtime();
+  conn->in_flight++;
+  conn->sent++;
+
+  // http://docs.libuv.org/en/latest/stream.html#c.uv_write
+  r = uv_write(req, (uv_stream_t *)conn, &buf, 1, write_cb);
+  CHECK(r, "uv_write");
+}
+
+static void conn_fill(bench_conn_t *conn)
+{
+  while (conn->in_flight < config.pipeline && !conn_done(conn))
+    conn_send(conn);
+
+  if (conn->in_flight == 0 && conn_done(conn) && !uv_is_closing((uv_handle_t *)conn))
+    uv_close((uv_handle_t *)conn, close_cb);
+}
+
+static void write_cb(uv_write_t *req, int status)
+{
+  free(req);
+  /* writes still queued when the run ends are cancelled by closing their connection */
+  if (status == UV_ECANCELED)
+    return;
+  CHECK(status, "write_cb");
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf)
+{
+  buf->base = malloc(size);
+  buf->len = size;
+  if (buf->base == NULL)
+    log_error("alloc_cb buffer didn't properly initialize");
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+  bench_conn_t *conn = (bench_conn_t *)stream;
+  size_t left = nread;
+  uint64_t now = uv_hrtime();
+
+  if (nread < 0)
+  {
+    if (nread != UV_EOF)
+      CHECK(nread, "read_cb");
+    log_error("server closed the connection with %d messages in flight", conn->in_flight);
+    free(buf->base);
+    conn->in_flight = 0;
+    stopping = 1;
+    uv_close((uv_handle_t *)conn, close_cb);
+    return;
+  }
+
+  bytes_received += nread;
+
+  /* echoes come back in order, so every `size` bytes complete the oldest message in flight */
+  while (left > 0 && conn->in_flight > 0)
+  {
+    size_t need = config.size - conn->partial;
+    if (left < need)
+    {
+      conn->partial += left;
+      break;
+    }
+    left -= need;
+    conn->partial = 0;
+    luv_hist_record(&hist, now - conn->sent_at[conn->head]);
+    conn->head = (conn->head + 1) % config.pipeline;
+    conn->in_flight--;
+    conn->received++;
+  }
+
+  free(buf->base);
+  conn_fill(conn);
+}
+
+static void connect_cb(uv_connect_t *req, int status)
+{
+  int r;
+  bench_conn_t *conn = (bench_conn_t *)req->handle;
+
+  /* the run ended before we got connected */
+  if (status == UV_ECANCELED)
+    return;
+  CHECK(status, "connect_cb");
+
+  // http://docs.libuv.org/en/latest/tcp.html#c.uv_tcp_nodelay
+  r = uv_tcp_nodelay((uv_tcp_t *)conn, 1);
+  CHECK(r, "uv_tcp_nodelay");
+
+  // http://docs.libuv.org/en/latest/stream.html#c.uv_read_start
+  r = uv_read_start((uv_stream_t *)conn, alloc_cb, read_cb);
+  CHECK(r, "uv_read_start");
+
+  conn_fill(conn);
+}
+
+static void duration_cb(uv_timer_t *timer)
+{
+  int i;
+  stopping = 1;
+
+  /* let the messages in flight come back, conn_fill closes each connection once it's idle */
+  for (i = 0; i < config.connections; i++)
+  {
+    if (!uv_is_closing((uv_handle_t *)&conns[i]) && conns[i].in_flight == 0)
+      uv_close((uv_handle_t *)&conns[i], close_cb);
+  }
+}
+
+static void report()
+{
+  int i;
+  uint64_t messages = 0;
+  double secs = (end_time - start_time) / 1e9;
+
+  for (i = 0; i < config.connections; i++)
+    messages += conns[i].received;
+
+  log_info("%d connections, %d in flight each, %zu byte messages, %.2f s",
+           config.connections, config.pipeline, config.size, secs);
+  log_info("%llu messages, %.0f msg/s, %.2f MB/s",
+           (unsigned long long)messages,
+           messages / secs,
+           bytes_received / secs / (1024 * 1024));
+  log_info("latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us",
+           luv_hist_percentile(&hist, 50) / 1e3,
+           luv_hist_percentile(&hist, 99) / 1e3,
+           luv_hist_percentile(&hist, 99.9) / 1e3,
+           hist.max / 1e3);
+}
+
+static void parse_args(int argc, char **argv)
+{
+  int i;
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--host") && i + 1 < argc)
+    {
+      config.host = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--port") && i + 1 < argc)
+    {
+      config.port = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--connections") && i + 1 < argc)
+    {
+      config.connections = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--pipeline") && i + 1 < argc)
+    {
+      config.pipeline = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--size") && i + 1 < argc)
+    {
+      config.size = strtoul(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--count") && i + 1 < argc)
+    {
+      config.count = strtoull(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--duration") && i + 1 < argc)
+    {
+      config.duration = strtoull(argv[++i], NULL, 10);
+    }
+    else
+    {
+      log_error("Usage: %s [--host HOST] [--port PORT] [--connections N] [--pipeline M] [--size BYTES] "
+                "[--count MESSAGES | --duration SECONDS]",
+                argv[0]);
+      exit(1);
+    }
+  }
+
+  if (config.connections < 1 || config.pipeline < 1 || config.size < 1)
+  {
+    log_error("--connections, --pipeline and --size must be positive");
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int r = 0;
+  int i;
+  struct sockaddr_in addr;
+  uv_loop_t *loop = uv_default_loop();
+
+  parse_args(argc, argv);
+
+  // http://docs.libuv.org/en/latest/misc.html#c.uv_ip4_addr
+  r = uv_ip4_addr(config.host ? config.host : HOST, config.port ? config.port : PORT, &addr);
+  CHECK(r, "uv_ip4_addr");
+
+  /* every message is the same, newline terminated so line based servers see one message each */
+  payload = malloc(config.size);
+  memset(payload, 'x', config.size);
+  payload[config.size - 1] = '\n';
+
+  // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_init
+  r = uv_timer_init(loop, &duration_timer);
+  CHECK(r, "uv_timer_init");
+
+  conns = calloc(config.connections, sizeof(bench_conn_t));
+  start_time = uv_hrtime();
+  for (i = 0; i < config.connections; i++)
+  {
+    bench_conn_t *conn = &conns[i];
+    conn->sent_at = malloc(config.pipeline * sizeof(uint64_t));
+
+    // http://docs.libuv.org/en/latest/tcp.html#c.uv_tcp_connect
+    r = uv_tcp_init(loop, &conn->tcp);
+    CHECK(r, "uv_tcp_init");
+    r = uv_tcp_connect(&conn->connect_req, &conn->tcp, (struct sockaddr *)&addr, connect_cb);
+    CHECK(r, "uv_tcp_connect");
+    conns_open++;
+  }
+
+  if (config.duration)
+  {
+    // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_start
+    r = uv_timer_start(&duration_timer, duration_cb, config.duration * 1000, 0);
+    CHECK(r, "uv_timer_start");
+  }
+
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  report();
+
+  for (i = 0; i < config.connections; i++)
+    free(conns[i].sent_at);
+  free(conns);
+  free(payload);
+
+  MAKE_VALGRIND_HAPPY();
+
+  return 0;
+}
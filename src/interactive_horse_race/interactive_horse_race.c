@@ -1,88 +1,269 @@
 #include "interactive_horse_race.h"
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <signal.h>
 #include <string.h>
 
-#define TIME_TO_ANSWER 1E7 * 4
-#define TRACKS MAX_CLIENTS
-#define to_s(x) #x
+#define ANSWER_TICKS (20000 / TICK_MS) /* 20 seconds to answer a question */
+#define STATS_TICKS (10000 / TICK_MS)  /* every loop logs its rooms and tick lag every 10 seconds */
+#define TRACKS PLAYERS
+#define str(x) #x
+#define to_s(x) str(x) /* expand TRACKS first, otherwise the pool gets "TRACKS" and falls back to one thread */
 #define THREADS to_s(TRACKS)
 
 #define HOST "0.0.0.0" /* localhost */
 #define PORT 7001
 
-static void start_game(uv_loop_t *loop, luv_game_t *game)
+static void start_game(luv_rooms_t *rooms, luv_game_t *game)
 {
-  log_info("Initializing track");
-  track_init(loop, game->server->clients, game->server->num_clients);
+  int i;
+
+  /* everyone in the room gets the track of their seat */
+  for (i = 0; i < game->num_players; i++)
+    ((luv_player_t *)game->players[i]->data)->track = i;
+
+  log_info("Initializing track for room %d", game->id);
+  track_init(game);
+  game->seed = luv_rand_next(&rooms->rng);
+  luv_rand_seed(&game->rng, game->seed, game->id);
   game->in_progress = 1;
-  game->delay = DELAY;
+  game->track_tick = rooms->tick + TRACK_TICKS;
+  luv_recorder_start(game->recorder, game, rooms->tick);
+}
+
+static void write_be32(char *buf, uint32_t v)
+{
+  buf[0] = v >> 24;
+  buf[1] = v >> 16;
+  buf[2] = v >> 8;
+  buf[3] = v;
 }
 
-static void question_handler(uv_idle_t *handle)
+static uint32_t read_be32(const char *buf)
 {
-  luv_game_t *game = handle->data;
-  luv_server_t *server = game->server;
+  const unsigned char *b = (const unsigned char *)buf;
+  return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
 
+static void question_handler(luv_rooms_t *rooms, luv_game_t *game)
+{
   if (!game->in_progress)
   {
-    if (server->num_clients < MAX_CLIENTS)
+    if (game->num_players < PLAYERS)
       return;
-    log_info("Starting the race");
-    luv_server_broadcast(server, "\nAll tracks filled, let the race begin!\n");
-    start_game(handle->loop, game);
+    log_info("Starting the race in room %d", game->id);
+    luv_rooms_broadcast(rooms, game, "\nAll tracks filled, let the race begin!\n");
+    start_game(rooms, game);
   }
   if (game->question_asked)
   {
-    if (--game->time_to_answer > 0)
+    if (rooms->tick < game->answer_deadline)
       return;
-    luv_server_broadcast(server, "\nWay too slow guys! Next question.\n");
+    luv_rooms_broadcast(rooms, game, "\nWay too slow guys! Next question.\n");
     game->question_asked = 0;
   }
 
-  game->question = luv_questions_get();
+  game->question = luv_questions_get(&rooms->rng);
+  game->question_id++;
   game->question_asked = 1;
-  game->time_to_answer = TIME_TO_ANSWER;
+  game->answer_deadline = rooms->tick + ANSWER_TICKS;
+  luv_recorder_question(game->recorder, game, rooms->tick);
 
-  luv_server_broadcast(server, "\n%s\n ? ", game->question.question);
+  char text[QUESTION_LEN + 8];
+  char body[4 + QUESTION_LEN];
+  int text_len = snprintf(text, sizeof(text), "\n%s\n ? ", game->question->question);
+  int question_len = strlen(game->question->question);
+  write_be32(body, game->question_id);
+  memcpy(body + 4, game->question->question, question_len);
+  luv_server_multicast_frame(rooms->server, game->players, game->num_players,
+                             text, text_len, LUV_FRAME_QUESTION, body, 4 + question_len);
+}
+
+/*
+ * Runs every TICK_MS and ticks all rooms in one go. When the loop was held up for longer than that we run the ticks we
+ * missed, so the game keeps the same pace on a loaded machine instead of slowing down with it.
+ * The timer is re-armed for the next tick's deadline rather than repeating, which would drift by however long each
+ * callback took.
+ */
+static void game_tick_cb(uv_timer_t *timer)
+{
+  int i;
+  luv_rooms_t *rooms = timer->data;
+  uint64_t now = uv_now(timer->loop);
+  uint64_t due = (now - rooms->epoch) / TICK_MS;
+
+  // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_start
+  uv_timer_start(timer, game_tick_cb, rooms->epoch + (due + 1) * TICK_MS - now, 0);
+
+  if (rooms->tick >= due)
+    return;
+
+  /* how far behind the schedule of the first tick we owe, a busy loop shows up here first */
+  rooms->tick_lag = now - rooms->epoch - (rooms->tick + 1) * TICK_MS;
+  if (rooms->tick_lag > rooms->max_tick_lag)
+    rooms->max_tick_lag = rooms->tick_lag;
+
+  while (rooms->tick < due)
+  {
+    rooms->tick++;
+    for (i = 0; i < rooms->num_rooms; i++)
+    {
+      question_handler(rooms, &rooms->rooms[i]);
+      track_handler(&rooms->rooms[i], rooms->tick);
+    }
+    if (rooms->tick % STATS_TICKS == 0)
+    {
+      log_info("loop %d: %d rooms, %d players, tick lag %llu ms, max %llu ms",
+               rooms->shard, rooms->num_rooms, rooms->server->num_clients,
+               (unsigned long long)rooms->tick_lag, (unsigned long long)rooms->max_tick_lag);
+      rooms->max_tick_lag = 0;
+      if (rooms->recorder != NULL)
+        log_info("loop %d: recorded %llu records, dropped %llu since the disk couldn't keep up", rooms->shard,
+                 (unsigned long long)rooms->recorder->records, (unsigned long long)rooms->recorder->dropped);
+    }
+  }
 }
 
 static void onclient_connected(luv_client_t *client, int total_connections)
 {
   luv_server_t *server = client->server;
+  luv_rooms_t *rooms = server->data;
 
-  /* todo: update track if client gets moved to different slot */
+  /* tracks are handed out when the race starts, until then nobody has a horse */
   luv_player_t *player = malloc(sizeof(luv_player_t));
   client->data = player;
   player->client = client;
-  player->track = client->slot;
+  player->track = -1;
+  player->speed = 0;
+
+  luv_game_t *game = luv_rooms_join(rooms, player);
 
-  log_info("New player, %d total now.", total_connections);
-  luv_server_broadcast(client->server,
-                       "Welcome player %d!\nWe now have a total of %d players.\n",
-                       client->id, total_connections);
+  log_info("New player in room %d, %d total now.", game->id, total_connections);
+  luv_rooms_broadcast(rooms, game,
+                      "Welcome player %d!\nWe now have %d of %d players in room %d.\n",
+                      client->id, game->num_players, PLAYERS, game->id);
 
   char client_msg[MAX_MSG];
-  snprintf(client_msg, MAX_MSG,
-           "Welcome to the game, you are on track %d\n", player->track + 1);
+  snprintf(client_msg, MAX_MSG, "Welcome to the game, you'll get a track once %d players joined\n", PLAYERS);
   luv_server_send(server, client, client_msg, strlen(client_msg));
 }
 
 static void onclient_disconnected(luv_client_t *client, int total_connections)
 {
-  log_info("Player %d quit, %d total now.", client->id, total_connections);
-  luv_server_broadcast(client->server,
-                       "Player quit %d :(\nWe have %d players left.\n",
-                       client->id, total_connections);
+  luv_rooms_t *rooms = client->server->data;
+  luv_player_t *player = client->data;
+  int room = player->room;
+  int id = luv_rooms_get(rooms, player)->id;
+
+  log_info("Player %d quit room %d, %d total now.", client->id, id, total_connections);
+  if (luv_rooms_get(rooms, player)->in_progress)
+    luv_recorder_leave(rooms->recorder, luv_rooms_get(rooms, player), rooms->tick, player);
+  luv_rooms_leave(rooms, player);
+
+  /* the room is gone once the last player left, or another room moved into its slot */
+  if (room < rooms->num_rooms && rooms->rooms[room].id == id)
+    luv_rooms_broadcast(rooms, &rooms->rooms[room],
+                        "Player quit %d :(\nWe have %d players left.\n",
+                        client->id, rooms->rooms[room].num_players);
+}
+
+static int answer_is_correct(const luv_question_t *question, const char *given, int given_len)
+{
+  const char *correct = question->answer;
+  int correct_len = strlen(correct);
+
+  /* messages are whole lines now, so the answer has to match exactly */
+  return given_len == correct_len && !strncasecmp(correct, given, correct_len);
+}
+
+/*
+ * With --max-in-flight answers are checked on the thread pool against the question asked when they arrived.
+ * Questions never change once initialized, so the pool may read the one we point it to while the room moves on.
+ */
+static void onclient_prepare(luv_client_msg_t *msg)
+{
+  luv_rooms_t *rooms = msg->client->server->data;
+  luv_game_t *game = luv_rooms_get(rooms, (luv_player_t *)msg->client->data);
+
+  if (game->in_progress && (!msg->binary || (msg->len >= 5 && msg->buf[0] == LUV_FRAME_ANSWER)))
+    msg->input = game->question;
+}
+
+static void onclient_work(luv_client_msg_t *msg)
+{
+  if (msg->binary)
+    msg->result = answer_is_correct(msg->input, msg->buf + 5, msg->len - 5);
+  else
+    msg->result = answer_is_correct(msg->input, msg->buf, msg->len);
+}
+
+/* the pool's verdict if it was about the question still asked, otherwise we check the answer here */
+static int answer_verdict(luv_game_t *game, luv_client_msg_t *msg, const char *given, int given_len)
+{
+  if (msg->input != NULL && msg->input == game->question)
+    return msg->result;
+  return answer_is_correct(game->question, given, given_len);
+}
+
+/* same rules as the text protocol, but the result is a fixed size frame and never repeats the question */
+static void onclient_frame(luv_client_msg_t *msg)
+{
+  char res[8];
+  luv_client_t *client = msg->client;
+  luv_rooms_t *rooms = client->server->data;
+  luv_player_t *player = client->data;
+  luv_game_t *game = luv_rooms_get(rooms, player);
+  uint32_t question_id;
+  int result;
+
+  if (msg->buf[0] != LUV_FRAME_ANSWER || msg->len < 5)
+  {
+    log_warn("Client %d sent an unknown frame '%c' of %zu bytes", client->id, msg->buf[0], msg->len);
+    return;
+  }
+
+  question_id = read_be32(msg->buf + 1);
+  if (!game->in_progress || !game->question_asked || question_id != game->question_id)
+  {
+    result = LUV_RESULT_STALE;
+  }
+  else if (answer_verdict(game, msg, msg->buf + 5, msg->len - 5))
+  {
+    result = LUV_RESULT_CORRECT;
+    player->speed++;
+    game->question_asked = 0;
+  }
+  else
+  {
+    result = LUV_RESULT_WRONG;
+    player->speed = fmax(0, player->speed - 1);
+  }
+  luv_recorder_answer(game->recorder, game, rooms->tick, player, result, msg->buf + 5, msg->len - 5);
+
+  write_be32(res, question_id);
+  res[4] = result;
+  res[5] = 0;
+  res[6] = player->speed >> 8;
+  res[7] = player->speed;
+  luv_server_send_frame(client->server, client, LUV_FRAME_RESULT, res, sizeof(res));
 }
 
 static void onclient_msg(luv_client_msg_t *msg, luv_onclient_msg_processed respond)
 {
   luv_client_t *client = msg->client;
-  log_info("Got message %s from client %d", msg->buf, msg->client->id);
 
-  luv_server_t *server = client->server;
-  luv_game_t *game = server->data;
+  if (msg->binary)
+  {
+    onclient_frame(msg);
+    return;
+  }
+
+  log_info("Got message %.*s from client %d", (int)msg->len, msg->buf, msg->client->id);
+
+  luv_rooms_t *rooms = client->server->data;
   luv_player_t *player = client->data;
+  luv_game_t *game = luv_rooms_get(rooms, player);
 
   if (!game->in_progress)
   {
@@ -90,16 +271,12 @@ static void onclient_msg(luv_client_msg_t *msg, luv_onclient_msg_processed respo
     return;
   }
 
-  char *correct = game->question.answer;
-  char *given = msg->buf;
-  int correct_len = strlen(correct);
-  int given_len = msg->len;
-
   char res[MAX_MSG];
 
-  if (!strncasecmp(correct, given, fmin(correct_len, given_len)))
+  if (answer_verdict(game, msg, msg->buf, msg->len))
   {
     player->speed++;
+    luv_recorder_answer(game->recorder, game, rooms->tick, player, LUV_RESULT_CORRECT, msg->buf, msg->len);
 
     sprintf(res, "Your answer is correct! Your speed is now %d\n", player->speed);
     game->question_asked = 0;
@@ -107,46 +284,377 @@ static void onclient_msg(luv_client_msg_t *msg, luv_onclient_msg_processed respo
   else
   {
     player->speed = fmax(0, player->speed - 1);
-    sprintf(res, "Your answer is wrong! Your speed is now %d\n\n%s\n ? ", player->speed, game->question.question);
+    luv_recorder_answer(game->recorder, game, rooms->tick, player, LUV_RESULT_WRONG, msg->buf, msg->len);
+    sprintf(res, "Your answer is wrong! Your speed is now %d\n\n%s\n ? ", player->speed, game->question->question);
   }
 
   respond(msg, res);
 }
 
-int main(void)
+typedef struct
+{
+  int loops;
+  int max_clients;
+  size_t max_queued;
+  uint64_t evict_timeout;
+  const char *record; /* path to record the races to, every loop but a single one appends its id */
+  uint64_t seed;      /* questions and races are the same for the same seed and the same players */
+  int max_in_flight;  /* answers per client checked on the thread pool at once, 0 checks them on the loop */
+} race_config_t;
+
+static race_config_t config = {
+    .loops = 1,
+    .max_clients = DEFAULT_MAX_CLIENTS,
+    .max_queued = DEFAULT_MAX_QUEUED,
+    .evict_timeout = DEFAULT_EVICT_TIMEOUT};
+
+/*
+ * Each race loop owns a uv_loop_t with its own server and rooms.
+ * By default there is exactly one, running on `uv_default_loop()` and listening itself.
+ * With `--loops K` we spawn K threads, the default loop only accepts connections and hands every PLAYERS consecutive
+ * ones to the same race loop. So all players of a room end up on one loop and nothing the game touches needs a lock.
+ */
+typedef struct
+{
+  int id;
+  uv_loop_t *loop;
+  uv_thread_t thread;
+  luv_server_t server;
+  luv_rooms_t rooms;
+  luv_recorder_t recorder;
+  uv_async_t handoff; /* wakes the loop up to take over the sockets in `pending` */
+  uv_mutex_t lock;    /* protects `pending`, the only thing the acceptor shares with the loop */
+  uv_os_sock_t *pending;
+  int num_pending;
+  int pending_cap;
+  int stopping; /* also protected by `lock`, set once the process is asked to shut down */
+} race_loop_t;
+
+static race_loop_t *race_loops;
+static int num_race_loops;
+static uv_tcp_t acceptor;
+static uint64_t accepted;
+static uv_signal_t sigint_handle;
+static uv_signal_t sigterm_handle;
+
+static void race_loop_init(race_loop_t *rl, const char *host)
 {
+  int r;
+
+  log_info("Creating server");
+  luv_server_init(
+      &rl->server, rl->loop, host, PORT, onclient_connected, onclient_disconnected, onclient_msg);
+  /* the limit is for the whole process, the acceptor spreads connections evenly */
+  rl->server.max_clients = (config.max_clients + num_race_loops - 1) / num_race_loops;
+  rl->server.max_queued = config.max_queued;
+  rl->server.evict_timeout = config.evict_timeout;
+  rl->server.max_in_flight = config.max_in_flight;
+  rl->server.onclient_prepare = onclient_prepare;
+  rl->server.onclient_work = onclient_work;
+  rl->server.ids = rl->id;
+  rl->server.id_stride = num_race_loops;
+
+  log_info("Initializing game loop");
+  luv_rooms_init(&rl->rooms, rl->loop, &rl->server);
+  rl->rooms.ids = rl->id;
+  rl->rooms.id_stride = num_race_loops;
+  rl->rooms.shard = rl->id;
+  luv_rand_seed(&rl->rooms.rng, config.seed, rl->id);
+  rl->server.data = &rl->rooms;
+
+  if (config.record != NULL)
+  {
+    char path[PATH_MAX];
+    if (num_race_loops == 1)
+      snprintf(path, sizeof(path), "%s", config.record);
+    else
+      snprintf(path, sizeof(path), "%s.%d", config.record, rl->id);
+    r = luv_recorder_init(&rl->recorder, rl->loop, path);
+    CHECK(r, "luv_recorder_init");
+    rl->rooms.recorder = &rl->recorder;
+    rl->recorder.data = rl;
+    log_info("Recording races to %s", path);
+  }
+
+  // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_start
+  uv_timer_start(&rl->rooms.timer, game_tick_cb, TICK_MS, 0);
+}
+
+static void recorder_closed_cb(luv_recorder_t *recorder)
+{
+  race_loop_t *rl = recorder->data;
+  uv_stop(rl->loop);
+}
+
+/* runs on the loop's own thread, a recording is written out completely before the loop stops */
+static void race_loop_stop(race_loop_t *rl)
+{
+  if (rl->rooms.recorder != NULL)
+    luv_recorder_close(rl->rooms.recorder, recorder_closed_cb);
+  else
+    uv_stop(rl->loop);
+}
+
+static void handoff_cb(uv_async_t *handle)
+{
+  int i, num_pending, stopping;
+  uv_os_sock_t *pending;
+  race_loop_t *rl = handle->data;
+
+  /* take the whole batch, so we don't hold the lock while opening connections */
+  uv_mutex_lock(&rl->lock);
+  pending = rl->pending;
+  num_pending = rl->num_pending;
+  rl->pending = NULL;
+  rl->num_pending = rl->pending_cap = 0;
+  stopping = rl->stopping;
+  rl->stopping = 0;
+  uv_mutex_unlock(&rl->lock);
+
+  if (stopping)
+    race_loop_stop(rl);
+
+  for (i = 0; i < num_pending; i++)
+    luv_server_open(&rl->server, pending[i]);
+  free(pending);
+}
+
+static void race_loop_handoff(race_loop_t *rl, uv_os_sock_t sock)
+{
+  uv_mutex_lock(&rl->lock);
+  if (rl->num_pending == rl->pending_cap)
+  {
+    rl->pending_cap = rl->pending_cap ? rl->pending_cap * 2 : 16;
+    rl->pending = realloc(rl->pending, rl->pending_cap * sizeof(uv_os_sock_t));
+  }
+  rl->pending[rl->num_pending++] = sock;
+  uv_mutex_unlock(&rl->lock);
+
+  // http://docs.libuv.org/en/latest/async.html#c.uv_async_send
+  uv_async_send(&rl->handoff);
+}
+
+static void accepted_close_cb(uv_handle_t *handle)
+{
+  free(handle);
+}
+
+/*
+ * Accepts on the default loop and passes a duplicate of the socket to a race loop, which opens it with uv_tcp_open.
+ * Closing our handle then leaves the race loop as the only owner of the connection.
+ */
+static void onaccept(uv_stream_t *server, int status)
+{
+  int r;
+  uv_os_fd_t fd;
+  uv_os_sock_t sock;
+  race_loop_t *rl;
+
+  CHECK(status, "onaccept");
+
+  uv_tcp_t *conn = malloc(sizeof(uv_tcp_t));
+  r = uv_tcp_init(server->loop, conn);
+  CHECK(r, "uv_tcp_init");
+
+  r = uv_accept(server, (uv_stream_t *)conn);
+  if (r)
+  {
+    log_error("trying to accept connection %d", r);
+    uv_close((uv_handle_t *)conn, accepted_close_cb);
+    return;
+  }
+
+  // http://docs.libuv.org/en/latest/handle.html#c.uv_fileno
+  r = uv_fileno((uv_handle_t *)conn, &fd);
+  CHECK(r, "uv_fileno");
+  sock = dup(fd);
+  uv_close((uv_handle_t *)conn, accepted_close_cb);
+  if (sock < 0)
+  {
+    log_error("trying to dup connection %d", errno);
+    return;
+  }
+
+  /* every PLAYERS consecutive connections fill a room, so they go to the same loop */
+  rl = &race_loops[(accepted++ / PLAYERS) % num_race_loops];
+  race_loop_handoff(rl, sock);
+}
+
+static void acceptor_listen(uv_loop_t *loop)
+{
+  int r;
+  struct sockaddr_in addr;
+
+  r = uv_tcp_init(loop, &acceptor);
+  CHECK(r, "uv_tcp_init");
+  r = uv_ip4_addr(HOST, PORT, &addr);
+  CHECK(r, "uv_ip4_addr");
+  r = uv_tcp_bind(&acceptor, (struct sockaddr *)&addr, 0);
+  CHECK(r, "uv_tcp_bind");
+  r = uv_listen((uv_stream_t *)&acceptor, SOMAXCONN, onaccept);
+  CHECK(r, "uv_listen");
+  log_info("Listening on %s:%d with %d race loops", HOST, PORT, num_race_loops);
+}
+
+/* Ctrl-C or kill, a second one ends the process right away since the handlers are gone by then */
+static void signal_cb(uv_signal_t *handle, int signum)
+{
+  int i;
+
+  log_info("Received %s, shutting down", signum == SIGINT ? "SIGINT" : "SIGTERM");
+  // http://docs.libuv.org/en/latest/handle.html#c.uv_close
+  uv_close((uv_handle_t *)&sigint_handle, NULL);
+  uv_close((uv_handle_t *)&sigterm_handle, NULL);
+
+  if (num_race_loops == 1)
+  {
+    race_loop_stop(&race_loops[0]);
+    return;
+  }
+
+  for (i = 0; i < num_race_loops; i++)
+  {
+    uv_mutex_lock(&race_loops[i].lock);
+    race_loops[i].stopping = 1;
+    uv_mutex_unlock(&race_loops[i].lock);
+    uv_async_send(&race_loops[i].handoff);
+  }
+  /* main joins the race loops once they are done */
+  uv_stop(handle->loop);
+}
+
+static void race_loop_run(void *arg)
+{
+  race_loop_t *rl = arg;
+  uv_run(rl->loop, UV_RUN_DEFAULT);
+}
+
+static void parse_args(int argc, char **argv)
+{
+  int i;
+  config.seed = time(NULL);
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--loops") && i + 1 < argc)
+    {
+      config.loops = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--max-clients") && i + 1 < argc)
+    {
+      config.max_clients = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--max-queued") && i + 1 < argc)
+    {
+      config.max_queued = strtoul(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--evict-timeout") && i + 1 < argc)
+    {
+      config.evict_timeout = strtoull(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--record") && i + 1 < argc)
+    {
+      config.record = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+    {
+      config.seed = strtoull(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--max-in-flight") && i + 1 < argc)
+    {
+      config.max_in_flight = atoi(argv[++i]);
+    }
+    else
+    {
+      log_error("Usage: %s [--loops K] [--max-clients N] [--max-queued BYTES] [--evict-timeout MS] [--record PATH] "
+                "[--seed N] [--max-in-flight N], 0 disables a limit",
+                argv[0]);
+      exit(1);
+    }
+  }
+
+  if (config.loops < 1)
+  {
+    log_error("--loops must be positive");
+    exit(1);
+  }
+  if (config.max_in_flight < 0)
+  {
+    log_error("--max-in-flight must not be negative");
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int i, r;
+  luv_rand_t rng;
   uv_loop_t *loop = uv_default_loop();
 
+  parse_args(argc, argv);
+
+  /* writing to a client that reset its connection must fail with EPIPE instead of killing the server */
+  signal(SIGPIPE, SIG_IGN);
+
   /* Ensure that each horse gets its own thread, the default libuv threadpool size is 4 */
   setenv("UV_THREADPOOL_SIZE", THREADS, 1);
 
-  srand(time(NULL));
-  log_info("Initializing questions");
-  luv_questions_init();
+  log_info("Initializing questions with seed %llu", (unsigned long long)config.seed);
+  luv_rand_seed(&rng, config.seed, UINT64_MAX);
+  luv_questions_init(&rng);
 
-  log_info("Creating server");
-  luv_server_t server;
-  luv_server_init(
-      &server, loop, HOST, PORT, onclient_connected, onclient_disconnected, onclient_msg);
+  num_race_loops = config.loops;
+  race_loops = calloc(num_race_loops, sizeof(race_loop_t));
 
-  log_info("Starting server");
-  luv_server_start(&server, loop);
+  // http://docs.libuv.org/en/latest/signal.html#c.uv_signal_start
+  r = uv_signal_init(loop, &sigint_handle);
+  CHECK(r, "uv_signal_init");
+  r = uv_signal_start(&sigint_handle, signal_cb, SIGINT);
+  CHECK(r, "uv_signal_start");
+  r = uv_signal_init(loop, &sigterm_handle);
+  CHECK(r, "uv_signal_init");
+  r = uv_signal_start(&sigterm_handle, signal_cb, SIGTERM);
+  CHECK(r, "uv_signal_start");
 
-  log_info("Initializing game loop");
-  luv_game_t game = {.server = &server, .delay = DELAY};
-  server.data = &game;
+  if (num_race_loops == 1)
+  {
+    race_loops[0].loop = loop;
+    race_loop_init(&race_loops[0], HOST);
+
+    log_info("Starting server");
+    luv_server_start(&race_loops[0].server, loop);
+
+    uv_run(loop, UV_RUN_DEFAULT);
+  }
+  else
+  {
+    for (i = 0; i < num_race_loops; i++)
+    {
+      race_loop_t *rl = &race_loops[i];
+      rl->id = i;
+      rl->loop = malloc(sizeof(uv_loop_t));
+      // http://docs.libuv.org/en/latest/loop.html#c.uv_loop_init
+      r = uv_loop_init(rl->loop);
+      CHECK(r, "uv_loop_init");
+      race_loop_init(rl, NULL);
 
-  uv_idle_t question_handle;
-  uv_idle_init(loop, &question_handle);
-  question_handle.data = &game;
-  uv_idle_start(&question_handle, question_handler);
+      r = uv_mutex_init(&rl->lock);
+      CHECK(r, "uv_mutex_init");
+      // http://docs.libuv.org/en/latest/async.html#c.uv_async_init
+      r = uv_async_init(rl->loop, &rl->handoff, handoff_cb);
+      CHECK(r, "uv_async_init");
+      rl->handoff.data = rl;
 
-  uv_idle_t track_handle;
-  uv_idle_init(loop, &track_handle);
-  track_handle.data = &game;
-  uv_idle_start(&track_handle, track_handler);
+      // http://docs.libuv.org/en/latest/threading.html#c.uv_thread_create
+      r = uv_thread_create(&rl->thread, race_loop_run, rl);
+      CHECK(r, "uv_thread_create");
+    }
 
-  uv_run(loop, UV_RUN_DEFAULT);
+    acceptor_listen(loop);
+    uv_run(loop, UV_RUN_DEFAULT);
+
+    for (i = 0; i < num_race_loops; i++)
+      uv_thread_join(&race_loops[i].thread);
+  }
 
   MAKE_VALGRIND_HAPPY();
   return 0;
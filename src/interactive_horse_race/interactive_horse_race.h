@@ -14,8 +14,12 @@
 #endif
 
 #include "learnuv.h"
+#include "luv_framer.h"
+#include "luv_rand.h"
 
-#define DELAY 1E6
+/* the game advances in fixed ticks of TICK_MS, the horses move every TRACK_TICKS of them */
+#define TICK_MS 100
+#define TRACK_TICKS 5
 #define MAX_SPEED 20
 #define QUESTION_LEN 256
 
@@ -23,20 +27,51 @@
  * TCP server
  */
 
-#define MAX_CLIENTS 2
+/* players per race, one per track */
+#define PLAYERS 2
+/* default for luv_server_t.max_clients, can be changed with --max-clients */
+#define DEFAULT_MAX_CLIENTS 65536
+/* defaults for luv_server_t.max_queued and evict_timeout, can be changed with --max-queued and --evict-timeout */
+#define DEFAULT_MAX_QUEUED (64 * 1024)
+#define DEFAULT_EVICT_TIMEOUT 5000
+/* a client with this many times max_queued waiting is evicted right away */
+#define EVICT_HARD_FACTOR 4
+/* most messages coalesced into one write */
+#define MAX_IOV 16
+/* how often the server's timer probes how late the loop runs, rates and the max lag cover RATE_PROBES probes */
+#define LAG_PROBE_MS 100
+#define RATE_PROBES 10
+/* clients are counted by the power of two their write queue is below, see luv_server_t.queue_buckets */
+#define QUEUE_BUCKETS 65
 
-#define luv_server_broadcast(s, fmt, ...)                \
-  do                                                     \
-  {                                                      \
-    int i, __len;                                        \
-    char msg[MAX_MSG];                                   \
-    snprintf(msg, MAX_MSG, fmt, ##__VA_ARGS__);          \
-    __len = strlen(msg);                                 \
-    for (i = 0; i < (s)->num_clients; i++)               \
-      luv_server_send((s), (s)->clients[i], msg, __len); \
-  } while (0)
+/*
+ * Binary protocol for bots, a client switches to it by sending the line "BINARY".
+ * From then on every frame in either direction is a 2 byte length followed by that many bytes, the first of which is
+ * the frame type. All integers are big endian.
+ */
+#define LUV_FRAME_MAX_BODY (UINT16_MAX - 1) /* the length includes the type */
+#define LUV_FRAME_TEXT 'T'     /* server -> client: any other message, as text */
+#define LUV_FRAME_QUESTION 'Q' /* server -> client: u32 question id, question */
+#define LUV_FRAME_RESULT 'R'   /* server -> client: u32 question id, u8 LUV_RESULT_*, u8 unused, u16 speed */
+#define LUV_FRAME_ANSWER 'A'   /* client -> server: u32 question id, answer */
+
+#define LUV_RESULT_WRONG 0
+#define LUV_RESULT_CORRECT 1
+#define LUV_RESULT_STALE 2 /* the question was already answered or timed out, the speed didn't change */
 
 typedef struct luv_server_s luv_server_t;
+typedef struct luv_client_work_s luv_client_work_t;
+
+/*
+ * Outgoing messages are copied into a refcounted buffer, a broadcast formats it once and every client's write
+ * shares it. The buffer is released when the last write completes.
+ */
+typedef struct
+{
+  int refs;
+  size_t len;
+  char base[];
+} luv_shared_msg_t;
 
 typedef struct
 {
@@ -44,18 +79,63 @@ typedef struct
   int id;
   int slot;
   luv_server_t *server;
+  luv_framer_t framer; /* messages are newline terminated, a read may hold part of one or several */
+  int binary;          /* negotiated the binary protocol, see LUV_FRAME_* */
+  /*
+   * Outbound queue, a ring of messages waiting to be written.
+   * The first `writing` of them are in flight as a single write, `out_offset` bytes of the first one went out already.
+   */
+  luv_shared_msg_t **out;
+  int out_head;
+  int out_len;
+  int out_cap;
+  size_t out_offset;
+  size_t out_bytes; /* unsent bytes in the queue */
+  int writing;
+  uv_write_t write_req;
+  int over_budget; /* out_bytes exceeded max_queued at over_budget_since and hasn't dropped below since */
+  uint64_t over_budget_since;
+  int evicted;
+  /*
+   * Messages handed to the thread pool, see luv_server_t.max_in_flight. A ring in the order they arrived, the first
+   * `work_submitted` of them were queued on the pool and are kept until all before them are answered.
+   */
+  luv_client_work_t **work;
+  int work_head;
+  int work_len;
+  int work_cap;
+  int work_submitted;
+  int in_flight;
+  int work_paused; /* stopped reading until the ring drops below max_in_flight */
+  int closed; /* the handle was closed with work in flight, the last work item to complete frees the client */
   void *data;
 } luv_client_t;
 
+/* a single line or frame sent by a client, `buf` is only valid during the onclient_msg callback */
 typedef struct
 {
-  char *buf;
+  const char *buf;
   size_t len;
+  int binary; /* `buf` is a binary frame, starting with its type */
   luv_client_t *client;
+  /* only used with luv_server_t.max_in_flight, what onclient_prepare left for onclient_work and what that found */
+  const void *input;
+  int result;
 } luv_client_msg_t;
 
+/* a message waiting in the client's work ring, possibly on the thread pool */
+struct luv_client_work_s
+{
+  luv_client_msg_t msg;
+  uv_work_t req;
+  int command; /* a message for onclient_msg, or a reply to a command the server handles itself */
+  int done;    /* nothing left to compute, it is handled once everything that arrived before it was */
+  char buf[];  /* copy of the message, the read buffer is gone by the time a worker gets to it */
+};
+
 typedef void (*luv_onclient_msg_processed)(luv_client_msg_t *, char *);
 typedef void (*luv_onclient_msg)(luv_client_msg_t *, luv_onclient_msg_processed);
+typedef void (*luv_onclient_work)(luv_client_msg_t *);
 typedef void (*luv_onclient_connected)(luv_client_t *, int);
 typedef void (*luv_onclient_disconnected)(luv_client_t *, int);
 
@@ -65,9 +145,65 @@ struct luv_server_s
   uv_tcp_t tcp;
   const char *host;
   int port;
-  luv_client_t *clients[MAX_CLIENTS];
+  /*
+   * Client registry.
+   * `clients` is kept dense by moving the last client into the slot of one that quits, so broadcasts iterate a
+   * contiguous array. `by_id` is an open addressing table for lookups by client id, both grow as needed.
+   */
+  luv_client_t **clients;
   int num_clients;
+  int clients_cap;
+  luv_client_t **by_id;
+  int by_id_cap; /* power of two, kept at most half full */
+  int max_clients; /* connections beyond this are told the server is full, 0 means no limit */
   int ids;
+  int id_stride; /* ids go up by this, servers sharing a process can hand out distinct ids */
+  /* slow consumers, clients staying over max_queued for evict_timeout ms are disconnected, 0 disables it */
+  size_t max_queued;
+  uint64_t evict_timeout;
+  uv_timer_t evict_timer;
+  /*
+   * Messages each client may have on the thread pool at once, 0 handles everything right away on the loop.
+   * With it set a message is handled in three steps:
+   *   onclient_prepare runs on the loop as the message arrives and leaves what onclient_work needs in `msg->input`,
+   *     a snapshot since the loop goes on changing its state. Messages without an input skip the pool.
+   *   onclient_work runs on a pool thread, it may only read the message and its input and leaves its verdict in
+   *     `msg->result`. This is the place for expensive computations.
+   *   onclient_msg runs on the loop once everything the client sent before was handled, so it's where state changes
+   *     and every response belong. Replies to the server's own commands wait their turn just the same.
+   */
+  int max_in_flight;
+  luv_onclient_work onclient_prepare;
+  luv_onclient_work onclient_work;
+  /* counters */
+  uint64_t queued_bytes; /* currently queued over all clients */
+  uint64_t coalesced_writes;
+  uint64_t evictions;
+  uint64_t accepts;
+  uint64_t rejects; /* accepted but turned away since the server was full */
+  uint64_t disconnects;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t msgs_in;
+  uint64_t msgs_out;
+  /*
+   * Clients with a write queue of at least 2^(i-1) and below 2^i bytes, so the deepest queue is found by looking at
+   * QUEUE_BUCKETS counts instead of every client. Clients with nothing queued aren't counted.
+   */
+  int queue_buckets[QUEUE_BUCKETS];
+  /* loop lag, how much later than scheduled lag_timer fired, in microseconds */
+  uv_timer_t lag_timer;
+  uint64_t lag_due;
+  uint64_t loop_lag;
+  uint64_t max_loop_lag; /* over the previous RATE_PROBES probes */
+  uint64_t window_lag;   /* max of the probes so far in the current window */
+  int probes;
+  /* messages per second over the previous window and the counters when it ended */
+  double msgs_in_rate;
+  double msgs_out_rate;
+  uint64_t window_start;
+  uint64_t window_msgs_in;
+  uint64_t window_msgs_out;
   void *data;
   /* events */
   luv_onclient_connected onclient_connected;
@@ -75,7 +211,37 @@ struct luv_server_s
   luv_onclient_msg onclient_msg;
 };
 
-void luv_server_send(luv_server_t *self, luv_client_t *client, char *msg, int len);
+void luv_server_send(luv_server_t *self, luv_client_t *client, const char *msg, int len);
+void luv_server_broadcast(luv_server_t *self, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void luv_server_multicast(luv_server_t *self, luv_client_t **clients, int num_clients, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+void luv_server_send_frame(luv_server_t *self, luv_client_t *client, int type, const char *body, size_t len);
+void luv_server_multicast_frame(luv_server_t *self, luv_client_t **clients, int num_clients,
+                                const char *text, size_t text_len, int type, const char *body, size_t body_len);
+/* a snapshot of the server's counters, taking one doesn't depend on the number of clients */
+typedef struct
+{
+  int clients;
+  uint64_t accepts;
+  uint64_t rejects;
+  uint64_t disconnects;
+  uint64_t evictions;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t msgs_in;
+  uint64_t msgs_out;
+  double msgs_in_rate; /* per second, over the last RATE_PROBES * LAG_PROBE_MS */
+  double msgs_out_rate;
+  uint64_t queued_bytes;
+  uint64_t max_queue; /* no write queue holds more than this, rounded up to a power of two minus one */
+  uint64_t coalesced_writes;
+  uint64_t loop_lag; /* microseconds */
+  uint64_t max_loop_lag;
+} luv_server_stats_t;
+
+luv_client_t *luv_server_find(luv_server_t *self, int id);
+void luv_server_stats(luv_server_t *self, luv_server_stats_t *stats);
+void luv_server_open(luv_server_t *self, uv_os_sock_t sock);
 void luv_server_destroy(luv_server_t *);
 void luv_server_start(luv_server_t *, uv_loop_t *);
 
@@ -92,8 +258,9 @@ typedef struct
   char answer[QUESTION_LEN];
 } luv_question_t;
 
-void luv_questions_init();
-luv_question_t luv_questions_get();
+void luv_questions_init(luv_rand_t *rng);
+const luv_question_t *luv_questions_get(luv_rand_t *rng);
+int luv_questions_solve(const char *question, char *answer, size_t len);
 
 /*
  * Game
@@ -110,28 +277,142 @@ typedef struct
 typedef struct
 {
   luv_client_t *client;
-  luv_horse_t *horse;
+  int room; /* index into luv_rooms_t.rooms, rooms move so we don't keep a pointer */
+  int seat; /* index into the room's players */
   int color;
-  int track;
+  int track; /* -1 until the race starts */
   int speed;
   int position;
 } luv_player_t;
 
+typedef struct luv_recorder_s luv_recorder_t;
+
+/* a room, each runs its own race */
 typedef struct
 {
-  luv_server_t *server;
+  int id;
   int in_progress;
+  /* the horses of a room draw from their own generator, seeded with `seed` and the room id so a recording can replay them */
+  uint32_t seed;
+  luv_rand_t rng;
   int question_asked;
-  luv_question_t question;
-  int time_to_answer;
-  int delay;
+  const luv_question_t *question;
+  uint32_t question_id; /* goes up with every question, binary clients send it along with their answer */
+  uint64_t answer_deadline; /* tick at which the current question times out */
+  uint64_t track_tick;      /* tick at which the horses move next */
+  luv_client_t *players[PLAYERS];
+  int num_players;
+  luv_horse_t horses[PLAYERS];
+  luv_recorder_t *recorder; /* NULL unless the race is recorded */
 } luv_game_t;
 
+/*
+ * Rooms
+ */
+
+/*
+ * All rooms live in one dense array which is ticked from a single timer. A room that empties is replaced by the last
+ * one, same as the server's client registry.
+ */
+typedef struct
+{
+  luv_server_t *server;
+  luv_game_t *rooms;
+  int num_rooms;
+  int rooms_cap;
+  int filling; /* room new players join, -1 if we need to open one */
+  int ids;
+  int id_stride;
+  int shard; /* loop the rooms run on */
+  luv_recorder_t *recorder; /* handed to every room that opens */
+  luv_rand_t rng;           /* questions and room seeds of this loop */
+  /* scheduler, `tick` counts the ticks since `epoch` in loop time */
+  uv_timer_t timer;
+  uint64_t epoch;
+  uint64_t tick;
+  uint64_t tick_lag; /* how late the last tick ran in ms */
+  uint64_t max_tick_lag;
+} luv_rooms_t;
+
+#define luv_rooms_get(self, player) (&(self)->rooms[(player)->room])
+
+void luv_rooms_init(luv_rooms_t *self, uv_loop_t *loop, luv_server_t *server);
+luv_game_t *luv_rooms_join(luv_rooms_t *self, luv_player_t *player);
+void luv_rooms_leave(luv_rooms_t *self, luv_player_t *player);
+#define luv_rooms_broadcast(self, game, fmt, ...) \
+  luv_server_multicast((self)->server, (game)->players, (game)->num_players, fmt, ##__VA_ARGS__)
+
+/*
+ * Recorder
+ */
+
+/*
+ * Appends what happens in the races of a loop to a file, for race_replay to play back.
+ * Records go into one of REC_BUFS preallocated buffers, a full buffer is written out with uv_fs_write on the thread
+ * pool while the next one fills up. Should the disk fall so far behind that all buffers are waiting to be written,
+ * records are dropped rather than blocking the loop.
+ *
+ * The file starts with LUV_REC_MAGIC, a u8 version and a u16 TICK_MS. Each record is a u16 length of the whole
+ * record, a u8 type, a u32 room id and the u32 tick it happened at, followed by its body. All integers are big endian.
+ */
+#define REC_BUF_SIZE (64 * 1024)
+#define REC_BUFS 8
+#define REC_FLUSH_MS 1000 /* buffers that aren't full are written out this often */
+#define LUV_REC_MAGIC "LREC"
+#define LUV_REC_VERSION 2
+#define LUV_REC_HEADER 11 /* u16 len, u8 type, u32 room, u32 tick */
+
+#define LUV_REC_START 'S'    /* u32 seed, u8 players, for each u32 client id and u8 track */
+#define LUV_REC_QUESTION 'Q' /* u32 question id, question */
+#define LUV_REC_ANSWER 'A'   /* u32 client id, u32 ms since the recording started, u8 LUV_RESULT_*, u16 speed, answer */
+#define LUV_REC_POSITION 'P' /* u8 track, u32 position */
+#define LUV_REC_LEAVE 'L'    /* u32 client id */
+
+typedef struct
+{
+  uv_fs_t req;
+  luv_recorder_t *recorder;
+  char *base;
+  size_t len;
+  int writing;
+} luv_rec_buf_t;
+
+typedef void (*luv_recorder_close_cb)(luv_recorder_t *);
+
+struct luv_recorder_s
+{
+  uv_loop_t *loop;
+  uv_file file;
+  int64_t offset; /* in the file of the next buffer to be written */
+  luv_rec_buf_t bufs[REC_BUFS];
+  int current; /* buffer records go to, the others are written or empty */
+  uv_timer_t flush_timer;
+  uint64_t epoch;
+  uint64_t records;
+  uint64_t dropped;
+  int dropping; /* the last record was dropped, so we only warn once the disk starts falling behind */
+  int closing;  /* nothing is recorded anymore, the file is closed once the last write completed */
+  luv_recorder_close_cb close_cb;
+  void *data;
+};
+
+int luv_recorder_init(luv_recorder_t *self, uv_loop_t *loop, const char *path);
+void luv_recorder_flush(luv_recorder_t *self);
+/* writes out what is still buffered and closes the file, `cb` runs once all of it is on disk */
+void luv_recorder_close(luv_recorder_t *self, luv_recorder_close_cb cb);
+/* these do nothing when `self` is NULL, so callers can pass a room's recorder along unchecked */
+void luv_recorder_start(luv_recorder_t *self, luv_game_t *game, uint64_t tick);
+void luv_recorder_question(luv_recorder_t *self, luv_game_t *game, uint64_t tick);
+void luv_recorder_answer(luv_recorder_t *self, luv_game_t *game, uint64_t tick, luv_player_t *player, int result,
+                         const char *answer, size_t len);
+void luv_recorder_position(luv_recorder_t *self, luv_game_t *game, uint64_t tick, luv_horse_t *horse);
+void luv_recorder_leave(luv_recorder_t *self, luv_game_t *game, uint64_t tick, luv_player_t *player);
+
 /*
  * Track
  */
 
-void track_handler(uv_idle_t *);
-void track_init(uv_loop_t *, luv_client_t **, int);
+void track_handler(luv_game_t *, uint64_t tick);
+void track_init(luv_game_t *);
 
 #endif
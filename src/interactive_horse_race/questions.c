@@ -19,22 +19,22 @@ const luv_question_t canned_questions[CANNED_QUESTIONS_LEN] = {
     {"C function used to release memory", "free"},
 };
 
-static luv_question_t get_canned_question()
+static const luv_question_t *get_canned_question(luv_rand_t *rng)
 {
-  return canned_questions[rand() % CANNED_QUESTIONS_LEN];
+  return &canned_questions[luv_rand_below(rng, CANNED_QUESTIONS_LEN)];
 }
 
-static luv_question_t get_conversion_question()
+static const luv_question_t *get_conversion_question(luv_rand_t *rng)
 {
-  return conversion_questions[rand() % CONVERSION_QUESTIONS_LEN];
+  return &conversion_questions[luv_rand_below(rng, CONVERSION_QUESTIONS_LEN)];
 }
 
-static luv_question_t get_math_question()
+static const luv_question_t *get_math_question(luv_rand_t *rng)
 {
-  return math_questions[rand() % MATH_QUESTIONS_LEN];
+  return &math_questions[luv_rand_below(rng, MATH_QUESTIONS_LEN)];
 }
 
-static void init_math_questions()
+static void init_math_questions(luv_rand_t *rng)
 {
   static const char *ops = "+-*";
   int i, p1, p2, result, max;
@@ -43,10 +43,10 @@ static void init_math_questions()
 
   for (i = 0; i < MATH_QUESTIONS_LEN; i++)
   {
-    op = ops[rand() % 3];
+    op = ops[luv_rand_below(rng, 3)];
     max = op == '*' ? 10 : 100;
-    p1 = rand() % max;
-    p2 = rand() % max;
+    p1 = luv_rand_below(rng, max);
+    p2 = luv_rand_below(rng, max);
 
     switch (op)
     {
@@ -88,27 +88,52 @@ static void init_conversion_questions()
   }
 }
 
-void luv_questions_init()
+void luv_questions_init(luv_rand_t *rng)
 {
-  init_math_questions();
+  init_math_questions(rng);
   init_conversion_questions();
 }
 
-luv_question_t luv_questions_get()
+/*
+ * Works out the answer to any question luv_questions_get can hand out, without needing the tables of the server that
+ * asked it. Returns 0 if it isn't one of ours.
+ */
+int luv_questions_solve(const char *question, char *answer, size_t len)
 {
-  int r = rand() % 5;
+  int i, p1, p2, end = 0;
+  char op;
+
+  if (sscanf(question, "0x%x converted to DECIMAL%n", &p1, &end) == 1 && question[end] == '\0')
+    return snprintf(answer, len, "%d", p1) > 0;
+  if (sscanf(question, "%d converted to HEXADECIMAL%n", &p1, &end) == 1 && question[end] == '\0')
+    return snprintf(answer, len, "%x", p1) > 0;
+  if (sscanf(question, "%d %c %d =%n", &p1, &op, &p2, &end) == 3 && question[end] == '\0')
+    return snprintf(answer, len, "%d", op == '+' ? p1 + p2 : op == '-' ? p1 - p2 : p1 * p2) > 0;
+
+  for (i = 0; i < CANNED_QUESTIONS_LEN; i++)
+  {
+    if (!strcmp(question, canned_questions[i].question))
+      return snprintf(answer, len, "%s", canned_questions[i].answer) > 0;
+  }
+  return 0;
+}
+
+/* questions are shared by all rooms, they never change once initialized */
+const luv_question_t *luv_questions_get(luv_rand_t *rng)
+{
+  int r = luv_rand_below(rng, 5);
   switch (r)
   {
   case 0:
-    return get_canned_question();
+    return get_canned_question(rng);
 
   /* the conversion questions are kinda hard, so we favor math questions ;) */
   case 1:
   case 2:
   case 3:
-    return get_math_question();
+    return get_math_question(rng);
 
   default:
-    return get_conversion_question();
+    return get_conversion_question(rng);
   }
 }
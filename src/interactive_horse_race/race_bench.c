@@ -0,0 +1,569 @@
+#define _GNU_SOURCE /* memmem */
+#include "interactive_horse_race.h"
+#include "luv_hist.h"
+
+/*
+ * Load generator for interactive_horse_race.
+ * Opens N bot connections which switch to the binary protocol and answer every question they get, a configurable
+ * share of them correctly, wrong or late. Everything is measured in this process, so the numbers include the time it
+ * takes the bench to get to a connection.
+ *
+ *   race_bench --bots 2000 --duration 30
+ *   race_bench --bots 2000 --correct 50 --wrong 30 --late 10 --think 200
+ *   race_bench --bots 200 --burst 4
+ *
+ * It reports
+ *   fan-out:       how much later than the first player of a room the others get the same question
+ *   answer to ack: from sending an answer to its result coming back
+ *   tick jitter:   how far off the room's tick grid a question arrives, questions are only sent on ticks
+ *   misordered:    results that don't belong to the answer they should, with --burst every answer is preceded by
+ *                  wrong ones, so a server checking answers on its thread pool has to keep the results in order
+ *
+ * and exits with 1 if any result was misordered.
+ */
+
+const static char *HOST = "127.0.0.1";
+const static int PORT = 7001;
+
+#define ACKS_MAX 64 /* answers waiting for their result per bot, more are sent but not timed */
+
+typedef struct
+{
+  char *host;
+  int port;
+  int bots;
+  uint64_t duration; /* seconds */
+  /* what a bot does with a question in percent, whatever is left it ignores */
+  int correct;
+  int wrong;
+  int late;
+  uint64_t think;   /* ms before a bot answers */
+  uint64_t late_ms; /* ms before a late answer, by then the question was usually answered by somebody else */
+  int burst;        /* frames per answer, all but the last one wrong */
+} bench_config_t;
+
+/* an answer waiting for its result */
+typedef struct
+{
+  uint64_t sent;
+  uint32_t question_id;
+  int wrong; /* can't come back correct */
+} ack_t;
+
+typedef struct
+{
+  uv_tcp_t tcp; /* first field so we can cast between the bot and its stream */
+  uv_connect_t connect_req;
+  luv_framer_t framer;
+  int binary; /* the server acknowledged the binary protocol */
+  int room;   /* -1 until the server told us */
+  uv_timer_t answer_timer;
+  char answer[QUESTION_LEN + 8]; /* frame waiting for answer_timer */
+  size_t answer_len;
+  int answer_wrong;
+  ack_t acks[ACKS_MAX]; /* answers waiting for a result, oldest first */
+  int ack_head;
+  int num_acks;
+  int untracked; /* answers sent while acks was full, their results come after the ones in acks */
+} bot_t;
+
+/* the question a room is on, when the first of its players got it and where its tick grid is */
+typedef struct
+{
+  uint32_t question_id;
+  uint64_t first;
+  uint64_t epoch; /* arrival of the room's first question, 0 until then */
+} bench_room_t;
+
+static bench_config_t config = {
+    .port = 0,
+    .bots = 100,
+    .duration = 10,
+    .correct = 80,
+    .wrong = 10,
+    .late = 10,
+    .think = 0,
+    .late_ms = 1000,
+    .burst = 1};
+
+static bot_t *bots;
+static int bots_open;
+static bench_room_t *rooms;
+static int rooms_cap;
+static uv_timer_t duration_timer;
+static luv_rand_t rng;
+static uint64_t start_time;
+static uint64_t end_time;
+
+/* all in nanoseconds */
+static luv_hist_t fanout_hist;
+static luv_hist_t ack_hist;
+static luv_hist_t jitter_hist;
+
+static uint64_t questions;
+static uint64_t answered[3]; /* correct, wrong, late */
+static uint64_t results[3];  /* by LUV_RESULT_* */
+static uint64_t misordered;
+static uint64_t bytes_received;
+
+/* forward declarations */
+static void alloc_cb(uv_handle_t *, size_t, uv_buf_t *);
+static void read_cb(uv_stream_t *, ssize_t, const uv_buf_t *);
+static void write_cb(uv_write_t *, int);
+
+static uint32_t get_u32(const char *p)
+{
+  const unsigned char *b = (const unsigned char *)p;
+  return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+static void close_cb(uv_handle_t *handle)
+{
+  if (--bots_open == 0)
+  {
+    end_time = uv_hrtime();
+    uv_close((uv_handle_t *)&duration_timer, NULL);
+  }
+}
+
+static void bot_close(bot_t *bot)
+{
+  if (uv_is_closing((uv_handle_t *)bot))
+    return;
+  uv_close((uv_handle_t *)&bot->answer_timer, NULL);
+  uv_close((uv_handle_t *)bot, close_cb);
+}
+
+static void bot_write(bot_t *bot, const char *buf, size_t len)
+{
+  int r;
+  uv_write_t *req = malloc(sizeof(uv_write_t) + len);
+  uv_buf_t iov = uv_buf_init((char *)(req + 1), len);
+
+  memcpy(iov.base, buf, len);
+  // http://docs.libuv.org/en/latest/stream.html#c.uv_write
+  r = uv_write(req, (uv_stream_t *)bot, &iov, 1, write_cb);
+  if (r)
+    free(req);
+}
+
+static void write_cb(uv_write_t *req, int status)
+{
+  free(req);
+}
+
+static void bot_track(bot_t *bot, int wrong)
+{
+  ack_t *ack;
+
+  if (bot->num_acks == ACKS_MAX || bot->untracked > 0)
+  {
+    bot->untracked++;
+    return;
+  }
+  ack = &bot->acks[(bot->ack_head + bot->num_acks++) % ACKS_MAX];
+  ack->sent = uv_hrtime();
+  ack->question_id = get_u32(bot->answer + 3);
+  ack->wrong = wrong;
+}
+
+static void bot_send_answer(bot_t *bot)
+{
+  char frame[QUESTION_LEN + 9];
+  size_t len = bot->answer_len + 1;
+  int i;
+
+  /* no answer ends in a quote */
+  memcpy(frame, bot->answer, bot->answer_len);
+  frame[0] = (len - 2) >> 8;
+  frame[1] = len - 2;
+  frame[len - 1] = '\'';
+  for (i = 1; i < config.burst; i++)
+  {
+    bot_track(bot, 1);
+    bot_write(bot, frame, len);
+  }
+
+  bot_track(bot, bot->answer_wrong);
+  bot_write(bot, bot->answer, bot->answer_len);
+}
+
+static void answer_timer_cb(uv_timer_t *timer)
+{
+  bot_send_answer(timer->data);
+}
+
+static bench_room_t *room_get(int id)
+{
+  if (id >= rooms_cap)
+  {
+    int cap = rooms_cap ? rooms_cap : 64;
+    while (cap <= id)
+      cap *= 2;
+    rooms = realloc(rooms, cap * sizeof(bench_room_t));
+    memset(rooms + rooms_cap, 0, (cap - rooms_cap) * sizeof(bench_room_t));
+    rooms_cap = cap;
+  }
+  return &rooms[id];
+}
+
+/* the first player of a room to get a question times the others and the room's tick */
+static void measure_question(bot_t *bot, uint32_t question_id, uint64_t now)
+{
+  uint64_t tick_ns = TICK_MS * 1000000ULL;
+  uint64_t phase;
+  bench_room_t *room;
+
+  if (bot->room < 0)
+    return;
+  room = room_get(bot->room);
+
+  if (room->epoch && room->question_id == question_id)
+  {
+    luv_hist_record(&fanout_hist, now - room->first);
+    return;
+  }
+
+  room->question_id = question_id;
+  room->first = now;
+  if (!room->epoch)
+  {
+    room->epoch = now;
+    return;
+  }
+  phase = (now - room->epoch) % tick_ns;
+  luv_hist_record(&jitter_hist, phase < tick_ns / 2 ? phase : tick_ns - phase);
+}
+
+static void onquestion(bot_t *bot, const char *body, size_t len)
+{
+  char question[QUESTION_LEN];
+  char answer[QUESTION_LEN];
+  uint64_t now = uv_hrtime();
+  uint64_t delay = config.think;
+  int dice = luv_rand_below(&rng, 100);
+  int wrong = 0;
+  size_t answer_len;
+
+  questions++;
+  measure_question(bot, get_u32(body), now);
+
+  snprintf(question, sizeof(question), "%.*s", (int)len - 4, body + 4);
+  if (!luv_questions_solve(question, answer, sizeof(answer)))
+    snprintf(answer, sizeof(answer), "?");
+
+  if (dice < config.correct)
+  {
+    answered[0]++;
+  }
+  else if (dice < config.correct + config.wrong)
+  {
+    /* no answer ends in a quote */
+    strcat(answer, "'");
+    wrong = 1;
+    answered[1]++;
+  }
+  else if (dice < config.correct + config.wrong + config.late)
+  {
+    delay = config.late_ms;
+    answered[2]++;
+  }
+  else
+  {
+    return;
+  }
+
+  answer_len = strlen(answer);
+  bot->answer[0] = (answer_len + 5) >> 8;
+  bot->answer[1] = answer_len + 5;
+  bot->answer[2] = LUV_FRAME_ANSWER;
+  memcpy(bot->answer + 3, body, 4);
+  memcpy(bot->answer + 7, answer, answer_len);
+  bot->answer_len = answer_len + 7;
+  bot->answer_wrong = wrong;
+
+  /* a new question replaces the answer we were still thinking about */
+  if (delay == 0)
+  {
+    uv_timer_stop(&bot->answer_timer);
+    bot_send_answer(bot);
+    return;
+  }
+  // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_start
+  uv_timer_start(&bot->answer_timer, answer_timer_cb, delay, 0);
+}
+
+static void onresult(bot_t *bot, const char *body, size_t len)
+{
+  ack_t *ack;
+
+  if (len < 8)
+    return;
+  if (bot->num_acks > 0)
+  {
+    ack = &bot->acks[bot->ack_head];
+    luv_hist_record(&ack_hist, uv_hrtime() - ack->sent);
+    if (ack->question_id != get_u32(body) || (ack->wrong && body[4] == LUV_RESULT_CORRECT))
+      misordered++;
+    bot->ack_head = (bot->ack_head + 1) % ACKS_MAX;
+    bot->num_acks--;
+  }
+  else if (bot->untracked > 0)
+  {
+    bot->untracked--;
+  }
+  if ((unsigned char)body[4] <= LUV_RESULT_STALE)
+    results[(int)body[4]]++;
+}
+
+static void ontext(bot_t *bot, const char *text, size_t len)
+{
+  const char *room = memmem(text, len, "players in room ", 16);
+  if (room != NULL && bot->room < 0)
+    bot->room = atoi(room + 16);
+}
+
+static int onframe(void *data, const char *frame, size_t len)
+{
+  static const char ack[] = "Binary protocol on";
+  bot_t *bot = data;
+
+  /* until the server acknowledges our switch we get lines, the acknowledgement itself is the first frame */
+  if (!bot->binary)
+  {
+    if (len >= sizeof(ack) - 1 && !memcmp(frame + len - (sizeof(ack) - 1), ack, sizeof(ack) - 1))
+    {
+      bot->binary = 1;
+      luv_framer_set_mode(&bot->framer, LUV_FRAMER_LENGTH);
+      return 0;
+    }
+    ontext(bot, frame, len);
+    return 0;
+  }
+
+  if (len == 0)
+    return 0;
+  switch (frame[0])
+  {
+  case LUV_FRAME_QUESTION:
+    if (len >= 5)
+      onquestion(bot, frame + 1, len - 1);
+    break;
+  case LUV_FRAME_RESULT:
+    onresult(bot, frame + 1, len - 1);
+    break;
+  case LUV_FRAME_TEXT:
+    ontext(bot, frame + 1, len - 1);
+    break;
+  }
+  return 0;
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf)
+{
+  buf->base = malloc(size);
+  buf->len = size;
+  if (buf->base == NULL)
+    log_error("alloc_cb buffer didn't properly initialize");
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+  bot_t *bot = (bot_t *)stream;
+
+  if (nread < 0)
+  {
+    if (nread != UV_EOF)
+      log_warn("bot read error %s", uv_err_name(nread));
+    free(buf->base);
+    bot_close(bot);
+    return;
+  }
+
+  bytes_received += nread;
+  luv_framer_feed(&bot->framer, buf->base, nread, onframe, bot);
+  free(buf->base);
+}
+
+static void connect_cb(uv_connect_t *req, int status)
+{
+  int r;
+  static const char hello[] = "BINARY\n";
+  bot_t *bot = (bot_t *)req->handle;
+
+  /* the run ended before we got connected */
+  if (status == UV_ECANCELED)
+    return;
+  if (status)
+  {
+    log_warn("bot connect failed %s", uv_err_name(status));
+    bot_close(bot);
+    return;
+  }
+
+  // http://docs.libuv.org/en/latest/tcp.html#c.uv_tcp_nodelay
+  r = uv_tcp_nodelay((uv_tcp_t *)bot, 1);
+  CHECK(r, "uv_tcp_nodelay");
+
+  // http://docs.libuv.org/en/latest/stream.html#c.uv_read_start
+  r = uv_read_start((uv_stream_t *)bot, alloc_cb, read_cb);
+  CHECK(r, "uv_read_start");
+
+  bot_write(bot, hello, sizeof(hello) - 1);
+}
+
+static void duration_cb(uv_timer_t *timer)
+{
+  int i;
+  for (i = 0; i < config.bots; i++)
+    bot_close(&bots[i]);
+}
+
+static void report_hist(const char *name, luv_hist_t *h)
+{
+  log_info("%-14s p50 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, max %.2f ms (%llu samples)", name,
+           luv_hist_percentile(h, 50) / 1e6,
+           luv_hist_percentile(h, 99) / 1e6,
+           luv_hist_percentile(h, 99.9) / 1e6,
+           h->max / 1e6,
+           (unsigned long long)h->total);
+}
+
+static void report()
+{
+  double secs = (end_time - start_time) / 1e9;
+
+  log_info("%d bots, %.2f s, %.2f MB received", config.bots, secs, bytes_received / (1024.0 * 1024));
+  log_info("%llu questions (%.0f/s), answered %llu correct, %llu wrong, %llu late",
+           (unsigned long long)questions, questions / secs,
+           (unsigned long long)answered[0], (unsigned long long)answered[1], (unsigned long long)answered[2]);
+  log_info("results %llu correct, %llu wrong, %llu stale",
+           (unsigned long long)results[LUV_RESULT_CORRECT], (unsigned long long)results[LUV_RESULT_WRONG],
+           (unsigned long long)results[LUV_RESULT_STALE]);
+  log_info("%llu misordered", (unsigned long long)misordered);
+  report_hist("fan-out", &fanout_hist);
+  report_hist("answer to ack", &ack_hist);
+  report_hist("tick jitter", &jitter_hist);
+}
+
+static void parse_args(int argc, char **argv)
+{
+  int i;
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--host") && i + 1 < argc)
+    {
+      config.host = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--port") && i + 1 < argc)
+    {
+      config.port = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--bots") && i + 1 < argc)
+    {
+      config.bots = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--duration") && i + 1 < argc)
+    {
+      config.duration = strtoull(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--correct") && i + 1 < argc)
+    {
+      config.correct = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--wrong") && i + 1 < argc)
+    {
+      config.wrong = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--late") && i + 1 < argc)
+    {
+      config.late = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--think") && i + 1 < argc)
+    {
+      config.think = strtoull(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--late-ms") && i + 1 < argc)
+    {
+      config.late_ms = strtoull(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--burst") && i + 1 < argc)
+    {
+      config.burst = atoi(argv[++i]);
+    }
+    else
+    {
+      log_error("Usage: %s [--host HOST] [--port PORT] [--bots N] [--duration SECONDS] "
+                "[--correct PERCENT] [--wrong PERCENT] [--late PERCENT] [--think MS] [--late-ms MS] "
+                "[--burst N]",
+                argv[0]);
+      exit(1);
+    }
+  }
+
+  if (config.bots < 1 || config.duration < 1 || config.burst < 1)
+  {
+    log_error("--bots, --duration and --burst must be positive");
+    exit(1);
+  }
+  if (config.correct < 0 || config.wrong < 0 || config.late < 0 || config.correct + config.wrong + config.late > 100)
+  {
+    log_error("--correct, --wrong and --late are percentages of the questions and can't add up to more than 100");
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int r = 0;
+  int i;
+  struct sockaddr_in addr;
+  uv_loop_t *loop = uv_default_loop();
+
+  parse_args(argc, argv);
+  luv_rand_seed(&rng, time(NULL), 0);
+
+  // http://docs.libuv.org/en/latest/misc.html#c.uv_ip4_addr
+  r = uv_ip4_addr(config.host ? config.host : HOST, config.port ? config.port : PORT, &addr);
+  CHECK(r, "uv_ip4_addr");
+
+  // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_init
+  r = uv_timer_init(loop, &duration_timer);
+  CHECK(r, "uv_timer_init");
+
+  bots = calloc(config.bots, sizeof(bot_t));
+  start_time = uv_hrtime();
+  for (i = 0; i < config.bots; i++)
+  {
+    bot_t *bot = &bots[i];
+    bot->room = -1;
+    luv_framer_init(&bot->framer, MAX_MSG);
+
+    r = uv_timer_init(loop, &bot->answer_timer);
+    CHECK(r, "uv_timer_init");
+    bot->answer_timer.data = bot;
+
+    // http://docs.libuv.org/en/latest/tcp.html#c.uv_tcp_connect
+    r = uv_tcp_init(loop, &bot->tcp);
+    CHECK(r, "uv_tcp_init");
+    r = uv_tcp_connect(&bot->connect_req, &bot->tcp, (struct sockaddr *)&addr, connect_cb);
+    CHECK(r, "uv_tcp_connect");
+    bots_open++;
+  }
+
+  // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_start
+  r = uv_timer_start(&duration_timer, duration_cb, config.duration * 1000, 0);
+  CHECK(r, "uv_timer_start");
+
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  report();
+
+  for (i = 0; i < config.bots; i++)
+    luv_framer_destroy(&bots[i].framer);
+  free(bots);
+  free(rooms);
+
+  MAKE_VALGRIND_HAPPY();
+  return misordered > 0;
+}
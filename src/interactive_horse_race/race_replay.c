@@ -0,0 +1,396 @@
+#include "interactive_horse_race.h"
+
+/*
+ * Plays back a recording of interactive_horse_race --record.
+ * Every room is rebuilt from its start record and its horses are moved by track_handler with the room's seed, the
+ * speeds come from the recorded answers. The recorded positions then have to match what track_handler does here,
+ * every one that doesn't is reported.
+ *
+ *   race_replay races.rec             as fast as possible
+ *   race_replay races.rec --speed 10  ten times faster than the races were run
+ */
+
+typedef struct
+{
+  luv_game_t game;
+  luv_client_t clients[PLAYERS]; /* the players only need an id and their player */
+  luv_player_t players[PLAYERS];
+} replay_room_t;
+
+typedef struct
+{
+  const char *path;
+  int speed; /* times real time, 0 doesn't wait at all */
+} replay_config_t;
+
+static replay_config_t config = {.path = NULL, .speed = 0};
+
+static char *data;
+static size_t data_len;
+static size_t pos; /* of the next record in `data` */
+static uint64_t tick; /* of the record being played */
+static uint64_t clock_tick; /* how far the paced replay got */
+static uv_timer_t replay_timer;
+
+/* sorted by id, rooms mostly start in the order they opened so they are usually appended */
+static replay_room_t **rooms;
+static int num_rooms;
+static int rooms_cap;
+
+static uint64_t records;
+static uint64_t answers;
+static uint64_t positions;
+static uint64_t mismatches;
+
+static uint16_t get_u16(const char *p)
+{
+  const unsigned char *b = (const unsigned char *)p;
+  return (b[0] << 8) | b[1];
+}
+
+static uint32_t get_u32(const char *p)
+{
+  const unsigned char *b = (const unsigned char *)p;
+  return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+static replay_room_t *room_find(uint32_t id)
+{
+  int lo = 0, hi = num_rooms - 1;
+  while (lo <= hi)
+  {
+    int mid = (lo + hi) / 2;
+    if ((uint32_t)rooms[mid]->game.id == id)
+      return rooms[mid];
+    if ((uint32_t)rooms[mid]->game.id < id)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return NULL;
+}
+
+static luv_player_t *room_player(replay_room_t *room, uint32_t client_id)
+{
+  int i;
+  for (i = 0; i < room->game.num_players; i++)
+  {
+    if ((uint32_t)room->game.players[i]->id == client_id)
+      return room->game.players[i]->data;
+  }
+  return NULL;
+}
+
+/* runs the track steps the server ran for the room up to and including `to` */
+static void room_advance(replay_room_t *room, uint64_t to)
+{
+  while (room->game.in_progress && room->game.track_tick <= to)
+    track_handler(&room->game, room->game.track_tick);
+}
+
+static void replay_start(uint32_t id, const char *body, size_t len)
+{
+  int i;
+  int num_players = (unsigned char)body[4];
+  replay_room_t *room;
+  luv_game_t *game;
+
+  /* a recording of a build with more PLAYERS, or a corrupt one, must not overflow the room */
+  if (num_players > PLAYERS || len < 5 + num_players * 5)
+  {
+    log_warn("room %u starts with %d players in a %zu byte record, we race at most %d, skipping it", id, num_players,
+             len, PLAYERS);
+    return;
+  }
+  for (i = 0; i < num_players; i++)
+  {
+    if ((unsigned char)body[9 + i * 5] >= PLAYERS)
+    {
+      log_warn("room %u puts a horse on track %d, we only have %d, skipping it", id, (unsigned char)body[9 + i * 5],
+               PLAYERS);
+      return;
+    }
+  }
+
+  room = calloc(1, sizeof(replay_room_t));
+  game = &room->game;
+  game->id = id;
+  game->num_players = num_players;
+  for (i = 0; i < game->num_players; i++)
+  {
+    room->clients[i].id = get_u32(body + 5 + i * 5);
+    room->clients[i].data = &room->players[i];
+    room->players[i].client = &room->clients[i];
+    room->players[i].track = (unsigned char)body[9 + i * 5];
+    game->players[i] = &room->clients[i];
+  }
+
+  /* same as start_game, the seed is drawn after the track is set up */
+  track_init(game);
+  game->seed = get_u32(body);
+  luv_rand_seed(&game->rng, game->seed, game->id);
+  game->in_progress = 1;
+  game->track_tick = tick + TRACK_TICKS;
+
+  if (num_rooms == rooms_cap)
+  {
+    rooms_cap = rooms_cap ? rooms_cap * 2 : 64;
+    rooms = realloc(rooms, rooms_cap * sizeof(replay_room_t *));
+  }
+  for (i = num_rooms; i > 0 && rooms[i - 1]->game.id > game->id; i--)
+    rooms[i] = rooms[i - 1];
+  rooms[i] = room;
+  num_rooms++;
+}
+
+static void replay_leave(replay_room_t *room, luv_player_t *player)
+{
+  int i;
+  luv_game_t *game = &room->game;
+
+  /* the order of the players doesn't matter to the track, they all draw the same number */
+  for (i = 0; i < game->num_players; i++)
+  {
+    if (game->players[i] == player->client)
+    {
+      game->players[i] = game->players[--game->num_players];
+      return;
+    }
+  }
+}
+
+/* the fixed part of each record's body, see LUV_REC_* */
+static size_t record_min_len(int type)
+{
+  switch (type)
+  {
+  case LUV_REC_START:
+    return 5;
+  case LUV_REC_ANSWER:
+    return 11;
+  case LUV_REC_POSITION:
+    return 5;
+  default:
+    return 4;
+  }
+}
+
+static void replay_record(int type, uint32_t id, const char *body, size_t len)
+{
+  replay_room_t *room;
+  luv_player_t *player;
+  int track;
+
+  if (len < record_min_len(type))
+  {
+    log_warn("record '%c' of room %u has only %zu bytes, skipping it", type, id, len);
+    return;
+  }
+  if (type == LUV_REC_START)
+  {
+    replay_start(id, body, len);
+    return;
+  }
+
+  room = room_find(id);
+  if (room == NULL)
+  {
+    log_warn("record '%c' for room %u which never started", type, id);
+    return;
+  }
+  room_advance(room, tick);
+
+  switch (type)
+  {
+  case LUV_REC_QUESTION:
+    log_info("Room %u asks question %u: %.*s", id, get_u32(body), (int)len - 4, body + 4);
+    break;
+  case LUV_REC_ANSWER:
+    answers++;
+    player = room_player(room, get_u32(body));
+    if (player == NULL)
+      break;
+    player->speed = get_u16(body + 9);
+    log_info("Room %u player %d answered %.*s after %u ms, speed %d", id, player->client->id, (int)len - 11,
+             body + 11, get_u32(body + 4), player->speed);
+    break;
+  case LUV_REC_POSITION:
+    track = (unsigned char)body[0];
+    if (track >= PLAYERS)
+    {
+      log_warn("Room %u tick %llu: position of a horse on track %d, we only have %d, skipping it", id,
+               (unsigned long long)tick, track, PLAYERS);
+      break;
+    }
+    positions++;
+    if (room->game.horses[track].position != (int)get_u32(body + 1))
+    {
+      mismatches++;
+      log_warn("Room %u tick %llu: horse on track %d is at %d, the recording has %u", id, (unsigned long long)tick,
+               track, room->game.horses[track].position, get_u32(body + 1));
+    }
+    break;
+  case LUV_REC_LEAVE:
+    player = room_player(room, get_u32(body));
+    if (player != NULL)
+      replay_leave(room, player);
+    break;
+  default:
+    log_warn("unknown record '%c'", type);
+  }
+}
+
+/* plays the records up to `until`, returns 0 once the recording is over */
+static int replay_until(uint64_t until)
+{
+  while (pos + LUV_REC_HEADER <= data_len)
+  {
+    const char *rec = data + pos;
+    size_t len = get_u16(rec);
+    uint64_t at = get_u32(rec + 7);
+
+    if (len < LUV_REC_HEADER || pos + len > data_len)
+    {
+      log_error("record at offset %zu is cut off", pos);
+      return 0;
+    }
+    if (at > until)
+      return 1;
+
+    tick = at;
+    replay_record(rec[2], get_u32(rec + 3), rec + LUV_REC_HEADER, len - LUV_REC_HEADER);
+    records++;
+    pos += len;
+  }
+  return 0;
+}
+
+static void replay_timer_cb(uv_timer_t *timer)
+{
+  int i;
+  int more = replay_until(++clock_tick);
+
+  /* keep the horses moving between records, for whoever is watching */
+  for (i = 0; i < num_rooms; i++)
+    room_advance(rooms[i], clock_tick);
+  if (!more)
+    uv_timer_stop(timer);
+}
+
+static void report()
+{
+  int i;
+
+  /* rooms only move when they have a record, catch them all up to the end of the recording */
+  for (i = 0; i < num_rooms; i++)
+    room_advance(rooms[i], tick);
+
+  log_info("%llu records, %d races, %llu answers, %llu positions, %llu ticks (%.1f s of racing)",
+           (unsigned long long)records, num_rooms, (unsigned long long)answers, (unsigned long long)positions,
+           (unsigned long long)tick, tick * TICK_MS / 1e3);
+  if (mismatches)
+    log_error("%llu positions differ from the recording", (unsigned long long)mismatches);
+  else
+    log_info("every position matches the recording");
+}
+
+static void load(uv_loop_t *loop)
+{
+  int r;
+  uv_fs_t req;
+  uv_buf_t iov;
+  uv_file file;
+  size_t cap = 1 << 20;
+
+  // http://docs.libuv.org/en/latest/fs.html#c.uv_fs_open
+  r = uv_fs_open(loop, &req, config.path, O_RDONLY, 0, NULL);
+  CHECK(r < 0 ? r : 0, "uv_fs_open");
+  file = r;
+  uv_fs_req_cleanup(&req);
+
+  data = malloc(cap);
+  for (;;)
+  {
+    if (data_len == cap)
+    {
+      cap *= 2;
+      data = realloc(data, cap);
+    }
+    iov = uv_buf_init(data + data_len, cap - data_len);
+    // http://docs.libuv.org/en/latest/fs.html#c.uv_fs_read
+    r = uv_fs_read(loop, &req, file, &iov, 1, -1, NULL);
+    uv_fs_req_cleanup(&req);
+    CHECK(r < 0 ? r : 0, "uv_fs_read");
+    if (r == 0)
+      break;
+    data_len += r;
+  }
+
+  uv_fs_close(loop, &req, file, NULL);
+  uv_fs_req_cleanup(&req);
+
+  if (data_len < 7 || memcmp(data, LUV_REC_MAGIC, 4) || data[4] != LUV_REC_VERSION)
+  {
+    log_error("%s is not a race recording", config.path);
+    exit(1);
+  }
+  if (get_u16(data + 5) != TICK_MS)
+    log_warn("the races were recorded with ticks of %d ms, replaying with %d ms", get_u16(data + 5), TICK_MS);
+  pos = 7;
+}
+
+static void parse_args(int argc, char **argv)
+{
+  int i;
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--speed") && i + 1 < argc)
+    {
+      config.speed = atoi(argv[++i]);
+    }
+    else if (config.path == NULL && argv[i][0] != '-')
+    {
+      config.path = argv[i];
+    }
+    else
+    {
+      config.path = NULL;
+      break;
+    }
+  }
+
+  if (config.path == NULL || config.speed < 0)
+  {
+    log_error("Usage: %s RECORDING [--speed N], N times real time, 0 as fast as possible", argv[0]);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int r;
+  uv_loop_t *loop = uv_default_loop();
+
+  parse_args(argc, argv);
+  load(loop);
+
+  if (config.speed == 0)
+  {
+    replay_until(UINT64_MAX);
+  }
+  else
+  {
+    // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_start
+    r = uv_timer_init(loop, &replay_timer);
+    CHECK(r, "uv_timer_init");
+    r = uv_timer_start(&replay_timer, replay_timer_cb, 0, TICK_MS / config.speed ? TICK_MS / config.speed : 1);
+    CHECK(r, "uv_timer_start");
+    uv_run(loop, UV_RUN_DEFAULT);
+  }
+
+  report();
+  free(data);
+
+  MAKE_VALGRIND_HAPPY();
+  return 0;
+}
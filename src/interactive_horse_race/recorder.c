@@ -0,0 +1,272 @@
+#include "interactive_horse_race.h"
+
+static char *put_u8(char *p, uint8_t v)
+{
+  *p++ = v;
+  return p;
+}
+
+static char *put_u16(char *p, uint16_t v)
+{
+  *p++ = v >> 8;
+  *p++ = v;
+  return p;
+}
+
+static char *put_u32(char *p, uint32_t v)
+{
+  *p++ = v >> 24;
+  *p++ = v >> 16;
+  *p++ = v >> 8;
+  *p++ = v;
+  return p;
+}
+
+/* closes the file of a closing recorder once the last of its buffers made it to disk */
+static void close_when_written(luv_recorder_t *self)
+{
+  int i;
+  uv_fs_t req;
+
+  for (i = 0; i < REC_BUFS; i++)
+  {
+    if (self->bufs[i].writing)
+      return;
+  }
+
+  // http://docs.libuv.org/en/latest/fs.html#c.uv_fs_close
+  uv_fs_close(self->loop, &req, self->file, NULL);
+  uv_fs_req_cleanup(&req);
+  for (i = 0; i < REC_BUFS; i++)
+    free(self->bufs[i].base);
+
+  if (self->dropped)
+    log_warn("recorded %llu records, dropped %llu since the disk couldn't keep up", (unsigned long long)self->records,
+             (unsigned long long)self->dropped);
+  else
+    log_info("recorded %llu records", (unsigned long long)self->records);
+  if (self->close_cb != NULL)
+    self->close_cb(self);
+}
+
+static void write_cb(uv_fs_t *req)
+{
+  luv_rec_buf_t *buf = req->data;
+
+  if (req->result < 0)
+    log_error("recorder write failed: %s", uv_err_name(req->result));
+  uv_fs_req_cleanup(req);
+  buf->len = 0;
+  buf->writing = 0;
+  if (buf->recorder->closing)
+    close_when_written(buf->recorder);
+}
+
+/* hands the current buffer to the thread pool and moves on to the next one */
+void luv_recorder_flush(luv_recorder_t *self)
+{
+  int r;
+  uv_buf_t iov;
+  luv_rec_buf_t *buf = &self->bufs[self->current];
+
+  if (buf->writing || buf->len == 0)
+    return;
+
+  buf->writing = 1;
+  buf->req.data = buf;
+  iov = uv_buf_init(buf->base, buf->len);
+
+  /* every buffer gets its own offset, so writes may complete in any order */
+  // http://docs.libuv.org/en/latest/fs.html#c.uv_fs_write
+  r = uv_fs_write(self->loop, &buf->req, self->file, &iov, 1, self->offset, write_cb);
+  CHECK(r, "uv_fs_write");
+  self->offset += buf->len;
+  self->current = (self->current + 1) % REC_BUFS;
+}
+
+static void flush_cb(uv_timer_t *timer)
+{
+  luv_recorder_flush(timer->data);
+}
+
+/* room for a record of `len` bytes with its header filled in, NULL if all buffers are still being written */
+static char *record_new(luv_recorder_t *self, int type, luv_game_t *game, uint64_t tick, size_t len)
+{
+  char *p;
+  luv_rec_buf_t *buf = &self->bufs[self->current];
+
+  if (self->closing)
+    return NULL;
+
+  len += LUV_REC_HEADER;
+  if (!buf->writing && buf->len + len > REC_BUF_SIZE)
+  {
+    luv_recorder_flush(self);
+    buf = &self->bufs[self->current];
+  }
+  if (buf->writing)
+  {
+    if (!self->dropping)
+      log_warn("recorder: all %d buffers are still being written, dropping records", REC_BUFS);
+    self->dropping = 1;
+    self->dropped++;
+    return NULL;
+  }
+  self->dropping = 0;
+
+  p = buf->base + buf->len;
+  buf->len += len;
+  self->records++;
+
+  p = put_u16(p, len);
+  p = put_u8(p, type);
+  p = put_u32(p, game->id);
+  p = put_u32(p, tick);
+  return p;
+}
+
+void luv_recorder_start(luv_recorder_t *self, luv_game_t *game, uint64_t tick)
+{
+  int i;
+  char *p;
+
+  if (self == NULL)
+    return;
+  p = record_new(self, LUV_REC_START, game, tick, 5 + game->num_players * 5);
+  if (p == NULL)
+    return;
+
+  p = put_u32(p, game->seed);
+  p = put_u8(p, game->num_players);
+  for (i = 0; i < game->num_players; i++)
+  {
+    p = put_u32(p, game->players[i]->id);
+    p = put_u8(p, ((luv_player_t *)game->players[i]->data)->track);
+  }
+}
+
+void luv_recorder_question(luv_recorder_t *self, luv_game_t *game, uint64_t tick)
+{
+  char *p;
+  size_t len;
+
+  if (self == NULL)
+    return;
+  len = strlen(game->question->question);
+  p = record_new(self, LUV_REC_QUESTION, game, tick, 4 + len);
+  if (p == NULL)
+    return;
+
+  p = put_u32(p, game->question_id);
+  memcpy(p, game->question->question, len);
+}
+
+void luv_recorder_answer(luv_recorder_t *self, luv_game_t *game, uint64_t tick, luv_player_t *player, int result,
+                         const char *answer, size_t len)
+{
+  char *p;
+
+  if (self == NULL)
+    return;
+  if (len > MAX_MSG)
+    len = MAX_MSG;
+  p = record_new(self, LUV_REC_ANSWER, game, tick, 11 + len);
+  if (p == NULL)
+    return;
+
+  p = put_u32(p, player->client->id);
+  p = put_u32(p, uv_now(self->loop) - self->epoch);
+  p = put_u8(p, result);
+  p = put_u16(p, player->speed);
+  memcpy(p, answer, len);
+}
+
+void luv_recorder_position(luv_recorder_t *self, luv_game_t *game, uint64_t tick, luv_horse_t *horse)
+{
+  char *p;
+
+  if (self == NULL)
+    return;
+  p = record_new(self, LUV_REC_POSITION, game, tick, 5);
+  if (p == NULL)
+    return;
+
+  p = put_u8(p, horse->track);
+  p = put_u32(p, horse->position);
+}
+
+void luv_recorder_leave(luv_recorder_t *self, luv_game_t *game, uint64_t tick, luv_player_t *player)
+{
+  char *p;
+
+  if (self == NULL)
+    return;
+  p = record_new(self, LUV_REC_LEAVE, game, tick, 4);
+  if (p == NULL)
+    return;
+
+  p = put_u32(p, player->client->id);
+}
+
+int luv_recorder_init(luv_recorder_t *self, uv_loop_t *loop, const char *path)
+{
+  int i, r;
+  uv_fs_t open_req;
+  char *p;
+
+  /* opening happens once at startup, so we do it synchronously */
+  // http://docs.libuv.org/en/latest/fs.html#c.uv_fs_open
+  r = uv_fs_open(loop, &open_req, path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP, NULL);
+  uv_fs_req_cleanup(&open_req);
+  if (r < 0)
+    return r;
+
+  self->loop = loop;
+  self->file = r;
+  self->offset = 0;
+  self->current = 0;
+  self->epoch = uv_now(loop);
+  self->records = 0;
+  self->dropped = 0;
+  self->dropping = 0;
+  self->closing = 0;
+  self->close_cb = NULL;
+  self->data = NULL;
+
+  for (i = 0; i < REC_BUFS; i++)
+  {
+    self->bufs[i].recorder = self;
+    self->bufs[i].base = malloc(REC_BUF_SIZE);
+    self->bufs[i].len = 0;
+    self->bufs[i].writing = 0;
+  }
+
+  p = self->bufs[0].base;
+  memcpy(p, LUV_REC_MAGIC, 4);
+  p = put_u8(p + 4, LUV_REC_VERSION);
+  p = put_u16(p, TICK_MS);
+  self->bufs[0].len = p - self->bufs[0].base;
+
+  // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_init
+  r = uv_timer_init(loop, &self->flush_timer);
+  CHECK(r, "uv_timer_init");
+  self->flush_timer.data = self;
+  r = uv_timer_start(&self->flush_timer, flush_cb, REC_FLUSH_MS, REC_FLUSH_MS);
+  CHECK(r, "uv_timer_start");
+  /* the recording shouldn't keep the loop alive on its own */
+  uv_unref((uv_handle_t *)&self->flush_timer);
+
+  return 0;
+}
+
+void luv_recorder_close(luv_recorder_t *self, luv_recorder_close_cb cb)
+{
+  self->closing = 1;
+  self->close_cb = cb;
+  // http://docs.libuv.org/en/latest/handle.html#c.uv_close
+  uv_close((uv_handle_t *)&self->flush_timer, NULL);
+
+  /* the buffer records went to last, all others are empty or being written already */
+  luv_recorder_flush(self);
+  close_when_written(self);
+}
@@ -0,0 +1,147 @@
+#include "interactive_horse_race.h"
+
+static int room_open(luv_rooms_t *self)
+{
+  luv_game_t *game;
+
+  if (self->num_rooms == self->rooms_cap)
+  {
+    self->rooms_cap = self->rooms_cap ? self->rooms_cap * 2 : 16;
+    self->rooms = realloc(self->rooms, self->rooms_cap * sizeof(luv_game_t));
+  }
+
+  game = &self->rooms[self->num_rooms];
+  memset(game, 0, sizeof(luv_game_t));
+  game->id = self->ids;
+  game->recorder = self->recorder;
+  self->ids += self->id_stride;
+  log_info("Opened room %d, %d rooms now.", game->id, self->num_rooms + 1);
+  return self->num_rooms++;
+}
+
+static void room_close(luv_rooms_t *self, int room)
+{
+  int i;
+  int last = self->num_rooms - 1;
+
+  log_info("Closed room %d, %d rooms left.", self->rooms[room].id, last);
+
+  /* unless the last room closed we move it into the freed slot and tell its players where it went */
+  if (room < last)
+  {
+    self->rooms[room] = self->rooms[last];
+    for (i = 0; i < self->rooms[room].num_players; i++)
+      ((luv_player_t *)self->rooms[room].players[i]->data)->room = room;
+    if (self->filling == last)
+      self->filling = room;
+  }
+  else if (self->filling == room)
+  {
+    self->filling = -1;
+  }
+
+  self->num_rooms--;
+}
+
+/* seats the player in the room that is waiting for players, opening one if there is none */
+luv_game_t *luv_rooms_join(luv_rooms_t *self, luv_player_t *player)
+{
+  luv_game_t *game;
+
+  if (self->filling < 0)
+    self->filling = room_open(self);
+
+  game = &self->rooms[self->filling];
+  player->room = self->filling;
+  player->seat = game->num_players;
+  game->players[game->num_players++] = player->client;
+
+  /* full rooms start their race on the next tick, later players go to a new room */
+  if (game->num_players == PLAYERS)
+    self->filling = -1;
+
+  return game;
+}
+
+/*
+ * Moves the players of a room that didn't start yet into the room that is filling up, as many as it has seats for.
+ * Otherwise they would wait for players that only ever join the filling room.
+ */
+static void room_merge(luv_rooms_t *self, int room)
+{
+  luv_game_t *from = &self->rooms[room];
+  luv_game_t *to = &self->rooms[self->filling];
+
+  log_info("Moving %d players from room %d to room %d.", from->num_players, from->id, to->id);
+  while (from->num_players > 0 && to->num_players < PLAYERS)
+  {
+    luv_client_t *client = from->players[--from->num_players];
+    luv_player_t *moved = client->data;
+    moved->room = self->filling;
+    moved->seat = to->num_players;
+    to->players[to->num_players++] = client;
+  }
+  luv_rooms_broadcast(self, to, "Players were moved over, we now have %d of %d players in room %d.\n", to->num_players,
+                      PLAYERS, to->id);
+
+  if (to->num_players == PLAYERS)
+    self->filling = -1;
+  if (from->num_players == 0)
+    room_close(self, room);
+  else if (self->filling < 0)
+    self->filling = room;
+}
+
+void luv_rooms_leave(luv_rooms_t *self, luv_player_t *player)
+{
+  luv_game_t *game = luv_rooms_get(self, player);
+  int last = game->num_players - 1;
+
+  if (player->seat < last)
+  {
+    game->players[player->seat] = game->players[last];
+    ((luv_player_t *)game->players[player->seat]->data)->seat = player->seat;
+  }
+  game->num_players--;
+
+  if (game->num_players == 0)
+  {
+    if (self->filling == player->room)
+      self->filling = -1;
+    room_close(self, player->room);
+  }
+  else if (!game->in_progress && self->filling < 0)
+  {
+    /* a full room that didn't start yet has a seat again */
+    self->filling = player->room;
+  }
+  else if (!game->in_progress && self->filling != player->room)
+  {
+    /* another room is filling up already, ours would never get new players */
+    room_merge(self, player->room);
+  }
+}
+
+void luv_rooms_init(luv_rooms_t *self, uv_loop_t *loop, luv_server_t *server)
+{
+  int r;
+
+  self->server = server;
+  self->rooms = NULL;
+  self->num_rooms = 0;
+  self->rooms_cap = 0;
+  self->filling = -1;
+  self->ids = 0;
+  self->id_stride = 1;
+  self->shard = 0;
+  self->recorder = NULL;
+  self->tick = 0;
+  self->tick_lag = 0;
+  self->max_tick_lag = 0;
+
+  // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_init
+  r = uv_timer_init(loop, &self->timer);
+  CHECK(r, "uv_timer_init");
+  self->timer.data = self;
+  self->epoch = uv_now(loop);
+}
@@ -1,7 +1,9 @@
 #include "interactive_horse_race.h"
+#include <stdarg.h>
+#include <strings.h>
 
 /* forward declarations */
-static void close_cb(uv_handle_t *client);
+static void close_cb(uv_handle_t *);
 static void client_shutdown_cb(uv_shutdown_t *, int);
 static void shutdown_cb(uv_shutdown_t *, int);
 
@@ -9,11 +11,43 @@ static void alloc_cb(uv_handle_t *, size_t, uv_buf_t *);
 static void read_cb(uv_stream_t *, ssize_t, const uv_buf_t *);
 static void onclient_msg_processed(luv_client_msg_t *, char *);
 
-static void close_cb(uv_handle_t *client)
+static void out_release(luv_client_t *);
+
+/* drops the work left in the ring, nothing of it is on the pool anymore */
+static void work_release(luv_client_t *client)
+{
+  while (client->work_len > 0)
+  {
+    free(client->work[client->work_head]);
+    client->work_head = (client->work_head + 1) % client->work_cap;
+    client->work_len--;
+  }
+  free(client->work);
+}
+
+static void client_free(luv_client_t *client)
 {
+  work_release(client);
   free(client->data); // free the player variable
   free(client);
+}
+
+static void close_cb(uv_handle_t *handle)
+{
+  luv_client_t *client = (luv_client_t *)handle;
+  /* closing cancelled the write in flight, so everything left can go */
+  out_release(client);
+  free(client->out);
+  luv_framer_destroy(&client->framer);
   log_info("Closed connection");
+
+  /* workers may still be looking at the client, the last one to complete frees it */
+  if (client->in_flight > 0)
+  {
+    client->closed = 1;
+    return;
+  }
+  client_free(client);
 }
 
 static void shutdown_cb(uv_shutdown_t *req, int status)
@@ -29,17 +63,316 @@ static void client_shutdown_cb(uv_shutdown_t *req, int status)
   free(req);
 }
 
+static luv_shared_msg_t *shared_msg_new(size_t len)
+{
+  luv_shared_msg_t *msg = malloc(sizeof(luv_shared_msg_t) + len + 1);
+  msg->refs = 1;
+  msg->len = len;
+  return msg;
+}
+
+static void shared_msg_unref(luv_shared_msg_t *msg)
+{
+  if (--msg->refs == 0)
+    free(msg);
+}
+
+static int queue_bucket(size_t bytes)
+{
+  return bytes ? 64 - __builtin_clzll(bytes) : 0;
+}
+
+/* all changes to a client's queue size go through here to keep the totals and the queue_buckets in sync */
+static void out_account(luv_client_t *client, size_t bytes, int add)
+{
+  luv_server_t *server = client->server;
+  int before = queue_bucket(client->out_bytes);
+  int after;
+
+  if (add)
+  {
+    client->out_bytes += bytes;
+    server->queued_bytes += bytes;
+  }
+  else
+  {
+    client->out_bytes -= bytes;
+    server->queued_bytes -= bytes;
+  }
+
+  after = queue_bucket(client->out_bytes);
+  if (before != after)
+  {
+    if (before)
+      server->queue_buckets[before]--;
+    if (after)
+      server->queue_buckets[after]++;
+  }
+}
+
+static void out_push(luv_client_t *client, luv_shared_msg_t *msg, size_t offset)
+{
+  int i;
+  if (client->out_len == client->out_cap)
+  {
+    /* unwrap the ring into the bigger array */
+    int cap = client->out_cap ? client->out_cap * 2 : 8;
+    luv_shared_msg_t **out = malloc(cap * sizeof(luv_shared_msg_t *));
+    for (i = 0; i < client->out_len; i++)
+      out[i] = client->out[(client->out_head + i) % client->out_cap];
+    free(client->out);
+    client->out = out;
+    client->out_cap = cap;
+    client->out_head = 0;
+  }
+
+  if (client->out_len == 0)
+    client->out_offset = offset;
+  client->out[(client->out_head + client->out_len) % client->out_cap] = msg;
+  client->out_len++;
+  msg->refs++;
+  out_account(client, msg->len - offset, 1);
+}
+
+static void out_pop(luv_client_t *client)
+{
+  luv_shared_msg_t *msg = client->out[client->out_head];
+  size_t unsent = msg->len - client->out_offset;
+
+  out_account(client, unsent, 0);
+  client->out_offset = 0;
+  client->out_head = (client->out_head + 1) % client->out_cap;
+  client->out_len--;
+  shared_msg_unref(msg);
+}
+
+/* drops everything that isn't part of a write in flight */
+static void out_release(luv_client_t *client)
+{
+  while (client->out_len > client->writing)
+  {
+    int last = (client->out_head + client->out_len - 1) % client->out_cap;
+    if (client->out_len == 1)
+    {
+      out_pop(client);
+      continue;
+    }
+    out_account(client, client->out[last]->len, 0);
+    shared_msg_unref(client->out[last]);
+    client->out_len--;
+  }
+}
+
+static void client_flush(luv_client_t *client);
+
 static void write_cb(uv_write_t *req, int status)
 {
-  CHECK(status, "write_cb");
-  free(req->bufs);
-  free(req);
+  luv_client_t *client = (luv_client_t *)req->handle;
+  luv_server_t *server = client->server;
+  size_t queued = client->out_bytes;
+
+  while (client->writing > 0)
+  {
+    out_pop(client);
+    client->writing--;
+  }
+
+  if (status)
+  {
+    /* the client went away, read_cb notices as well and disconnects it */
+    if (status != UV_EPIPE && status != UV_ECONNRESET && status != UV_ECANCELED)
+      log_warn("write_cb: %s", uv_err_name(status));
+    out_release(client);
+    return;
+  }
+
+  server->bytes_out += queued - client->out_bytes;
+  if (client->out_bytes <= server->max_queued)
+    client->over_budget = 0;
+  if (client->out_len > 0 && !uv_is_closing((uv_handle_t *)client))
+    client_flush(client);
 }
 
-static void disconnect(luv_client_t *client)
+/* writes up to MAX_IOV queued messages with a single writev */
+static void client_flush(luv_client_t *client)
+{
+  int i, r;
+  uv_buf_t bufs[MAX_IOV];
+  int n = client->out_len < MAX_IOV ? client->out_len : MAX_IOV;
+
+  for (i = 0; i < n; i++)
+  {
+    luv_shared_msg_t *msg = client->out[(client->out_head + i) % client->out_cap];
+    bufs[i] = uv_buf_init(msg->base, msg->len);
+  }
+  bufs[0].base += client->out_offset;
+  bufs[0].len -= client->out_offset;
+
+  client->writing = n;
+  if (n > 1)
+    client->server->coalesced_writes++;
+
+  // http://docs.libuv.org/en/latest/stream.html#c.uv_write
+  r = uv_write(&client->write_req, (uv_stream_t *)client, bufs, n, write_cb);
+  if (r)
+  {
+    /* the client is shutting down, nobody is going to read this anymore */
+    client->writing = 0;
+    out_release(client);
+  }
+}
+
+static void evict_cb(uv_timer_t *);
+
+static void client_check_budget(luv_client_t *client)
 {
-  int r;
   luv_server_t *server = client->server;
+  uint64_t now;
+
+  /* clients that never got registered only get told the server is full */
+  if (client->id < 0 || !server->max_queued || client->out_bytes <= server->max_queued)
+    return;
+
+  now = uv_now(server->tcp.loop);
+  if (!client->over_budget)
+  {
+    client->over_budget = 1;
+    client->over_budget_since = now;
+  }
+
+  if (client->out_bytes > server->max_queued * EVICT_HARD_FACTOR ||
+      (server->evict_timeout && now - client->over_budget_since >= server->evict_timeout))
+  {
+    /* we may be in the middle of a broadcast, so evict_cb disconnects it once we are done iterating the clients */
+    log_warn("Client %d has %zu bytes queued, evicting it", client->id, client->out_bytes);
+    client->evicted = 1;
+    server->evictions++;
+    uv_read_stop((uv_stream_t *)client);
+    out_release(client);
+    uv_timer_start(&server->evict_timer, evict_cb, 0, 0);
+  }
+}
+
+/*
+ * Messages are written right away while nothing is queued for the client, what didn't fit into the socket buffer is
+ * queued and written out together with whatever else gets queued in the meantime.
+ */
+static void client_write(luv_client_t *client, luv_shared_msg_t *msg)
+{
+  int r;
+  size_t offset = 0;
+
+  if (client->evicted)
+    return;
+
+  client->server->msgs_out++;
+  if (client->out_len == 0)
+  {
+    uv_buf_t buf = uv_buf_init(msg->base, msg->len);
+
+    // http://docs.libuv.org/en/latest/stream.html#c.uv_try_write
+    r = uv_try_write((uv_stream_t *)client, &buf, 1);
+    if (r > 0)
+      client->server->bytes_out += r;
+    if (r == (int)msg->len)
+      return;
+    if (r < 0 && r != UV_EAGAIN)
+    {
+      /* a client that went away shows up in read_cb as well, which disconnects it */
+      if (r != UV_EPIPE && r != UV_ECONNRESET)
+        log_warn("Client %d write error %s", client->id, uv_err_name(r));
+      return;
+    }
+    if (r > 0)
+      offset = r;
+  }
+
+  out_push(client, msg, offset);
+  if (!client->writing)
+    client_flush(client);
+  client_check_budget(client);
+}
+
+/*
+ * Our ids go up by id_stride, all of them leave the same remainder. Dividing by the stride makes them sequential again,
+ * so masking spreads clients over the table without collisions until it wraps.
+ */
+static int by_id_home(luv_server_t *server, int id)
+{
+  return (id / server->id_stride) & (server->by_id_cap - 1);
+}
+
+static int by_id_slot(luv_server_t *server, int id)
+{
+  int mask = server->by_id_cap - 1;
+  int i = by_id_home(server, id);
+  while (server->by_id[i] != NULL && server->by_id[i]->id != id)
+    i = (i + 1) & mask;
+  return i;
+}
+
+static void by_id_grow(luv_server_t *server)
+{
+  int i;
+  luv_client_t **old = server->by_id;
+  int old_cap = server->by_id_cap;
+
+  server->by_id_cap = old_cap ? old_cap * 2 : 64;
+  server->by_id = calloc(server->by_id_cap, sizeof(luv_client_t *));
+  for (i = 0; i < old_cap; i++)
+  {
+    if (old[i] != NULL)
+      server->by_id[by_id_slot(server, old[i]->id)] = old[i];
+  }
+  free(old);
+}
+
+/* Linear probing removal, shifts later entries of the same run back so lookups never need tombstones */
+static void by_id_remove(luv_server_t *server, int id)
+{
+  int mask = server->by_id_cap - 1;
+  int i = by_id_slot(server, id);
+  int j = i;
+
+  if (server->by_id[i] == NULL)
+    return;
+
+  for (;;)
+  {
+    server->by_id[i] = NULL;
+    for (;;)
+    {
+      int home;
+      j = (j + 1) & mask;
+      if (server->by_id[j] == NULL)
+        return;
+      home = by_id_home(server, server->by_id[j]->id);
+      /* an entry may only move back if its home slot isn't between the hole and itself */
+      if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+        break;
+    }
+    server->by_id[i] = server->by_id[j];
+    i = j;
+  }
+}
+
+static void registry_add(luv_server_t *server, luv_client_t *client)
+{
+  if (server->num_clients == server->clients_cap)
+  {
+    server->clients_cap = server->clients_cap ? server->clients_cap * 2 : 64;
+    server->clients = realloc(server->clients, server->clients_cap * sizeof(luv_client_t *));
+  }
+  if ((server->num_clients + 1) * 2 > server->by_id_cap)
+    by_id_grow(server);
+
+  client->slot = server->num_clients;
+  server->clients[server->num_clients++] = client;
+  server->by_id[by_id_slot(server, client->id)] = client;
+}
+
+static void registry_remove(luv_server_t *server, luv_client_t *client)
+{
   int last_slot = server->num_clients - 1;
 
   /* unless the last client quit we move the last client into its slot
@@ -51,12 +384,141 @@ static void disconnect(luv_client_t *client)
   }
 
   server->num_clients--;
+  by_id_remove(server, client->id);
+}
+
+static void disconnect(luv_client_t *client);
+
+static void evict_cb(uv_timer_t *timer)
+{
+  int i;
+  luv_server_t *server = timer->data;
+
+  /* going backwards, disconnecting a client only moves an already visited one into its slot */
+  for (i = server->num_clients - 1; i >= 0; i--)
+  {
+    if (i < server->num_clients && server->clients[i]->evicted)
+      disconnect(server->clients[i]);
+  }
+}
+
+void luv_server_stats(luv_server_t *self, luv_server_stats_t *stats)
+{
+  int i;
+
+  stats->clients = self->num_clients;
+  stats->accepts = self->accepts;
+  stats->rejects = self->rejects;
+  stats->disconnects = self->disconnects;
+  stats->evictions = self->evictions;
+  stats->bytes_in = self->bytes_in;
+  stats->bytes_out = self->bytes_out;
+  stats->msgs_in = self->msgs_in;
+  stats->msgs_out = self->msgs_out;
+  stats->msgs_in_rate = self->msgs_in_rate;
+  stats->msgs_out_rate = self->msgs_out_rate;
+  stats->queued_bytes = self->queued_bytes;
+  stats->coalesced_writes = self->coalesced_writes;
+  stats->loop_lag = self->loop_lag;
+  stats->max_loop_lag = self->max_loop_lag;
+
+  stats->max_queue = 0;
+  for (i = QUEUE_BUCKETS - 1; i > 0; i--)
+  {
+    if (self->queue_buckets[i] > 0)
+    {
+      stats->max_queue = i < 64 ? (1ULL << i) - 1 : UINT64_MAX;
+      break;
+    }
+  }
+}
+
+luv_client_t *luv_server_find(luv_server_t *self, int id)
+{
+  if (self->by_id_cap == 0)
+    return NULL;
+  return self->by_id[by_id_slot(self, id)];
+}
+
+static void disconnect(luv_client_t *client)
+{
+  int r;
+  luv_server_t *server = client->server;
+
+  registry_remove(server, client);
+  server->disconnects++;
   server->onclient_disconnected(client, server->num_clients);
 
+  /* an evicted client isn't reading what we send, waiting for it to drain the queue first would take forever */
+  if (client->evicted)
+  {
+    uv_close((uv_handle_t *)client, close_cb);
+    return;
+  }
+
   uv_shutdown_t *shutdown_req = malloc(sizeof(uv_shutdown_t));
   shutdown_req->data = client;
   r = uv_shutdown(shutdown_req, (uv_stream_t *)client, client_shutdown_cb);
-  CHECK(r, "uv_shutdown");
+  if (r)
+  {
+    /* the connection was reset, there is nothing left to shut down */
+    free(shutdown_req);
+    uv_close((uv_handle_t *)client, close_cb);
+  }
+}
+
+static luv_client_t *client_new(luv_server_t *server)
+{
+  int r;
+  luv_client_t *client = malloc(sizeof(luv_client_t));
+  luv_framer_init(&client->framer, MAX_MSG);
+  client->data = NULL;
+  client->server = server;
+  client->id = -1; /* until it is registered */
+  client->out = NULL;
+  client->out_head = client->out_len = client->out_cap = 0;
+  client->out_offset = client->out_bytes = 0;
+  client->writing = 0;
+  client->over_budget = 0;
+  client->evicted = 0;
+  client->binary = 0;
+  client->work = NULL;
+  client->work_head = client->work_len = client->work_cap = 0;
+  client->work_submitted = client->in_flight = 0;
+  client->work_paused = 0;
+  client->closed = 0;
+  r = uv_tcp_init(server->tcp.loop, (uv_tcp_t *)client);
+  CHECK(r, "uv_tcp_init");
+  return client;
+}
+
+/* registers a connected client and starts reading from it */
+static void client_admit(luv_server_t *server, luv_client_t *client)
+{
+  int r;
+
+  /* we accept anyways, so the client learns why it gets disconnected */
+  if (server->max_clients && server->num_clients >= server->max_clients)
+  {
+    static char full[] = "Sorry, the server is full.\n";
+    log_info("exceeded allowed number of clients");
+    server->rejects++;
+    luv_server_send(server, client, full, sizeof(full) - 1);
+    uv_shutdown_t *shutdown_req = malloc(sizeof(uv_shutdown_t));
+    r = uv_shutdown(shutdown_req, (uv_stream_t *)client, shutdown_cb);
+    CHECK(r, "uv_shutdown");
+    return;
+  }
+
+  client->id = server->ids;
+  server->ids += server->id_stride;
+  server->accepts++;
+  registry_add(server, client);
+  server->onclient_connected(client, server->num_clients);
+
+  /* Start reading data from client */
+  r = uv_read_start((uv_stream_t *)client, alloc_cb, read_cb);
+  CHECK(r, "uv_read_start");
 }
 
 static void onconnection(uv_stream_t *tcp, int status)
@@ -69,36 +531,36 @@ static void onconnection(uv_stream_t *tcp, int status)
   /* Accept client connection */
   log_info("Accepting Connection");
 
-  if (server->num_clients == MAX_CLIENTS)
+  luv_client_t *client = client_new(server);
+  r = uv_accept(tcp, (uv_stream_t *)client);
+  if (r)
   {
-    log_info("exceeded allowed number of clients");
-    /* todo: Ideally we'd allow the client to connect,  tell it and disconnect */
+    log_error("trying to accept connection %d", r);
+    /* never registered, so there is nobody to tell about it */
+    uv_close((uv_handle_t *)client, close_cb);
     return;
   }
 
-  luv_client_t *client = malloc(sizeof(luv_client_t));
-  r = uv_tcp_init(tcp->loop, (uv_tcp_t *)client);
-  CHECK(r, "uv_tcp_init");
+  client_admit(server, client);
+}
 
-  r = uv_accept(tcp, (uv_stream_t *)client);
+/* takes over a connection accepted elsewhere, for example on another loop */
+void luv_server_open(luv_server_t *self, uv_os_sock_t sock)
+{
+  int r;
+  luv_client_t *client = client_new(self);
+
+  // http://docs.libuv.org/en/latest/tcp.html#c.uv_tcp_open
+  r = uv_tcp_open((uv_tcp_t *)client, sock);
   if (r)
   {
-    log_error("trying to accept connection %d", r);
-    disconnect(client);
+    log_error("trying to open connection %d", r);
+    close(sock);
+    uv_close((uv_handle_t *)client, close_cb);
     return;
   }
 
-  server->clients[server->num_clients] = client;
-  client->server = server;
-  client->slot = server->num_clients;
-  client->id = server->ids++;
-
-  server->num_clients++;
-  server->onclient_connected(client, server->num_clients);
-
-  /* Start reading data from client */
-  r = uv_read_start((uv_stream_t *)client, alloc_cb, read_cb);
-  CHECK(r, "uv_read_start");
+  client_admit(self, client);
 }
 
 static void alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf)
@@ -109,16 +571,239 @@ static void alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf)
     log_error("alloc_cb buffer didn't properly initialize");
 }
 
+static void work_cb(uv_work_t *);
+static void after_work_cb(uv_work_t *, int);
+static void send_stats(luv_client_t *);
+
+/* what a work item is, besides a message for onclient_msg */
+#define WORK_MSG 0
+#define WORK_BINARY 1 /* the acknowledgement of the switch to the binary protocol */
+#define WORK_STATS 2
+
+/* queues the items that need the pool, up to max_in_flight at once, and skips over the ones that are done already */
+static void work_submit(luv_client_t *client)
+{
+  int r;
+  luv_server_t *server = client->server;
+
+  while (client->work_submitted < client->work_len)
+  {
+    luv_client_work_t *work = client->work[(client->work_head + client->work_submitted) % client->work_cap];
+    if (!work->done)
+    {
+      if (client->in_flight == server->max_in_flight)
+        return;
+      work->req.data = work;
+      // http://docs.libuv.org/en/latest/threadpool.html#c.uv_queue_work
+      r = uv_queue_work(server->tcp.loop, &work->req, work_cb, after_work_cb);
+      CHECK(r, "uv_queue_work");
+      client->in_flight++;
+    }
+    client->work_submitted++;
+  }
+}
+
+static void command_reply(luv_client_t *client, int command)
+{
+  static const char hello[] = "Binary protocol on\n";
+
+  if (command == WORK_BINARY)
+    luv_server_send(client->server, client, hello, sizeof(hello) - 1);
+  else if (command == WORK_STATS)
+    send_stats(client);
+}
+
+/* handles the items at the head of the ring that are done, on the loop and in the order they arrived */
+static void work_drain(luv_client_t *client)
+{
+  luv_server_t *server = client->server;
+
+  while (client->work_len > 0 && client->work[client->work_head]->done)
+  {
+    luv_client_work_t *work = client->work[client->work_head];
+    client->work_head = (client->work_head + 1) % client->work_cap;
+    client->work_len--;
+    client->work_submitted--;
+
+    /* a client that disconnected in the meantime isn't answered anymore, its player is gone already */
+    if (luv_server_find(server, client->id) == client)
+    {
+      if (work->command == WORK_MSG)
+        server->onclient_msg(&work->msg, onclient_msg_processed);
+      else
+        command_reply(client, work->command);
+    }
+    free(work);
+  }
+}
+
+/* copies the message into the client's work ring, reading pauses while max_in_flight items are waiting */
+static void work_push(luv_client_t *client, const char *buf, size_t len, int command)
+{
+  int i;
+  luv_server_t *server = client->server;
+  luv_client_work_t *work = malloc(sizeof(luv_client_work_t) + len);
+
+  if (len > 0)
+    memcpy(work->buf, buf, len);
+  work->msg.buf = work->buf;
+  work->msg.len = len;
+  work->msg.binary = client->binary;
+  work->msg.client = client;
+  work->msg.input = NULL;
+  work->msg.result = 0;
+  work->command = command;
+
+  /* the snapshot has to be taken now, on the loop, everything after it may happen on the pool */
+  if (command == WORK_MSG && server->onclient_prepare != NULL && server->onclient_work != NULL)
+    server->onclient_prepare(&work->msg);
+  work->done = work->msg.input == NULL;
+
+  if (client->work_len == client->work_cap)
+  {
+    /* unwrap the ring into the bigger array, same as the outbound queue */
+    int cap = client->work_cap ? client->work_cap * 2 : 8;
+    luv_client_work_t **ring = malloc(cap * sizeof(luv_client_work_t *));
+    for (i = 0; i < client->work_len; i++)
+      ring[i] = client->work[(client->work_head + i) % client->work_cap];
+    free(client->work);
+    client->work = ring;
+    client->work_cap = cap;
+    client->work_head = 0;
+  }
+  client->work[(client->work_head + client->work_len) % client->work_cap] = work;
+  client->work_len++;
+
+  work_submit(client);
+  work_drain(client);
+
+  /*
+   * the rest of this read still gets queued, but we don't read more until the pool caught up,
+   * whatever is left in the ring waits for work in flight, so after_work_cb resumes us
+   */
+  if (!client->work_paused && client->work_len >= server->max_in_flight)
+  {
+    client->work_paused = 1;
+    uv_read_stop((uv_stream_t *)client);
+  }
+}
+
+/* on a pool thread, the loop doesn't look at the work item until after_work_cb */
+static void work_cb(uv_work_t *req)
+{
+  luv_client_work_t *work = req->data;
+  work->msg.client->server->onclient_work(&work->msg);
+}
+
+static void after_work_cb(uv_work_t *req, int status)
+{
+  int r;
+  luv_client_work_t *work = req->data;
+  luv_client_t *client = work->msg.client;
+  luv_server_t *server = client->server;
+
+  work->done = 1;
+  client->in_flight--;
+
+  if (client->closed)
+  {
+    if (client->in_flight == 0)
+      client_free(client);
+    return;
+  }
+
+  work_submit(client);
+  work_drain(client);
+
+  if (!client->work_paused || client->work_len >= server->max_in_flight)
+    return;
+  client->work_paused = 0;
+
+  /* disconnected and evicted clients stay stopped */
+  if (!client->evicted && luv_server_find(server, client->id) == client)
+  {
+    // http://docs.libuv.org/en/latest/stream.html#c.uv_read_start
+    r = uv_read_start((uv_stream_t *)client, alloc_cb, read_cb);
+    CHECK(r, "uv_read_start");
+  }
+}
+
+static void send_stats(luv_client_t *client)
+{
+  char res[MAX_MSG];
+  int len;
+  luv_server_stats_t s;
+
+  luv_server_stats(client->server, &s);
+  len = snprintf(res, sizeof(res),
+                 "clients %d, accepts %llu, rejects %llu, disconnects %llu, evictions %llu\n"
+                 "bytes in %llu, out %llu\n"
+                 "messages in %llu (%.1f/s), out %llu (%.1f/s)\n"
+                 "write queues %llu bytes, deepest at most %llu bytes, coalesced writes %llu\n"
+                 "loop lag %.1f ms, max %.1f ms\n",
+                 s.clients, (unsigned long long)s.accepts, (unsigned long long)s.rejects,
+                 (unsigned long long)s.disconnects, (unsigned long long)s.evictions,
+                 (unsigned long long)s.bytes_in, (unsigned long long)s.bytes_out,
+                 (unsigned long long)s.msgs_in, s.msgs_in_rate, (unsigned long long)s.msgs_out, s.msgs_out_rate,
+                 (unsigned long long)s.queued_bytes, (unsigned long long)s.max_queue,
+                 (unsigned long long)s.coalesced_writes,
+                 s.loop_lag / 1e3, s.max_loop_lag / 1e3);
+  luv_server_send(client->server, client, res, len);
+}
+
+/* commands the server answers itself, with work in the ring the reply waits for it like any other */
+static void client_command(luv_client_t *client, int command)
+{
+  if (client->server->max_in_flight > 0)
+    work_push(client, NULL, 0, command);
+  else
+    command_reply(client, command);
+}
+
+static int onclient_line(void *data, const char *line, size_t len)
+{
+  luv_client_t *client = data;
+  luv_client_msg_t msg = {.buf = line, .len = len, .binary = client->binary, .client = client};
+
+  client->server->msgs_in++;
+
+  /* whatever follows in this read is already framed by length, so the switch can't wait */
+  if (!client->binary && len == 6 && !strncasecmp(line, "BINARY", 6))
+  {
+    client->binary = 1;
+    luv_framer_set_mode(&client->framer, LUV_FRAMER_LENGTH);
+    client_command(client, WORK_BINARY);
+    return 0;
+  }
+
+  if (!client->binary && len == 5 && !strncasecmp(line, "STATS", 5))
+  {
+    client_command(client, WORK_STATS);
+    return 0;
+  }
+
+  /* every binary frame has at least its type */
+  if (client->binary && len == 0)
+    return 0;
+
+  if (client->server->max_in_flight > 0)
+    work_push(client, line, len, WORK_MSG);
+  else
+    client->server->onclient_msg(&msg, onclient_msg_processed);
+  return 0;
+}
+
 static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
 {
+  int r;
   luv_client_t *client = (luv_client_t *)stream;
-  luv_server_t *server = client->server;
 
   /* Errors or EOF */
   if (nread < 0)
   {
+    /* a client going away must not take the server and everyone else with it */
     if (nread != UV_EOF)
-      CHECK(nread, "read_cb");
+      log_warn("Client %d read error %s, disconnecting", client->id, uv_err_name(nread));
     free(buf->base);
     disconnect(client);
     return;
@@ -130,41 +815,137 @@ static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
     return;
   }
 
-  luv_client_msg_t *msg = malloc(sizeof(luv_client_msg_t));
-  msg->buf = buf->base;
-  msg->len = nread;
-  msg->client = client;
+  client->server->bytes_in += nread;
 
-  server->onclient_msg(msg, onclient_msg_processed);
+  /* a command may be split across reads or several may arrive in one, the framer hands us one line at a time */
+  r = luv_framer_feed(&client->framer, buf->base, nread, onclient_line, client);
+  if (r == UV_ENOBUFS)
+    log_warn("Client %d sent a message longer than %d bytes, ignoring it", client->id, MAX_MSG);
+  free(buf->base);
 }
 
 static void onclient_msg_processed(luv_client_msg_t *msg, char *response)
 {
-  int r;
-  uv_write_t *write_req = malloc(sizeof(uv_write_t));
+  luv_server_send(msg->client->server, msg->client, response, strlen(response));
+}
 
-  int len = strlen(response);
-  uv_buf_t buf = uv_buf_init(response, len);
-  r = uv_write(write_req, (uv_stream_t *)msg->client, &buf, 1, write_cb);
+/* NULL if the body doesn't fit the 16 bit length */
+static luv_shared_msg_t *frame_new(int type, const char *body, size_t len)
+{
+  luv_shared_msg_t *frame;
+
+  if (len > LUV_FRAME_MAX_BODY)
+  {
+    log_error("'%c' frame of %zu bytes exceeds the maximum of %d, not sending it", type, len, LUV_FRAME_MAX_BODY);
+    return NULL;
+  }
 
-  free(msg->buf);
+  frame = shared_msg_new(len + 3);
+  frame->base[0] = (len + 1) >> 8;
+  frame->base[1] = (len + 1) & 0xff;
+  frame->base[2] = type;
+  memcpy(frame->base + 3, body, len);
+  return frame;
 }
 
-void luv_server_send(luv_server_t *self, luv_client_t *client, char *msg, int len)
+/*
+ * Sends `text` to clients using the text protocol and a `type` frame with `body` to binary ones.
+ * Each is only built once the first client needing it comes along and shared by all of them.
+ */
+static void multicast(luv_client_t **clients, int num_clients,
+                      luv_shared_msg_t *text, int type, const char *body, size_t body_len)
 {
-  int r;
-  uv_write_t *write_req;
+  int i;
+  int too_long = 0;
+  luv_shared_msg_t *frame = NULL;
+
+  /* we hold on to our own references while handing them out, so a write that completes right away can't free them */
+  for (i = 0; i < num_clients; i++)
+  {
+    if (!clients[i]->binary)
+    {
+      client_write(clients[i], text);
+      continue;
+    }
+    /* a body too long for a frame is only reported once, text clients still get the message */
+    if (frame == NULL && !too_long)
+      too_long = (frame = frame_new(type, body, body_len)) == NULL;
+    if (frame != NULL)
+      client_write(clients[i], frame);
+  }
+  if (frame != NULL)
+    shared_msg_unref(frame);
+}
+
+/* `msg` is copied, so callers can pass stack buffers */
+void luv_server_send(luv_server_t *self, luv_client_t *client, const char *msg, int len)
+{
+  luv_shared_msg_t *shared;
 
   if (client == NULL)
   {
-    log_warn("Client %d was not properly initialized, cannot send message to it.", client->id);
+    log_warn("Client was not properly initialized, cannot send message to it.");
     return;
   }
 
-  uv_buf_t buf = uv_buf_init(msg, len);
-  write_req = malloc(sizeof(uv_write_t));
-  r = uv_write(write_req, (uv_stream_t *)client, &buf, 1, write_cb);
-  CHECK(r, "uv_write");
+  shared = shared_msg_new(len);
+  memcpy(shared->base, msg, len);
+  multicast(&client, 1, shared, LUV_FRAME_TEXT, msg, len);
+  shared_msg_unref(shared);
+}
+
+/* binary clients only, the body is copied */
+void luv_server_send_frame(luv_server_t *self, luv_client_t *client, int type, const char *body, size_t len)
+{
+  luv_shared_msg_t *frame = frame_new(type, body, len);
+  if (frame == NULL)
+    return;
+  client_write(client, frame);
+  shared_msg_unref(frame);
+}
+
+void luv_server_multicast_frame(luv_server_t *self, luv_client_t **clients, int num_clients,
+                                const char *text, size_t text_len, int type, const char *body, size_t body_len)
+{
+  luv_shared_msg_t *msg = shared_msg_new(text_len);
+  memcpy(msg->base, text, text_len);
+  multicast(clients, num_clients, msg, type, body, body_len);
+  shared_msg_unref(msg);
+}
+
+static void vmulticast(luv_client_t **clients, int num_clients, const char *fmt, va_list ap)
+{
+  int len;
+  va_list ap2;
+  luv_shared_msg_t *msg;
+
+  va_copy(ap2, ap);
+  len = vsnprintf(NULL, 0, fmt, ap2);
+  va_end(ap2);
+
+  msg = shared_msg_new(len);
+  vsnprintf(msg->base, len + 1, fmt, ap);
+
+  /* binary clients get the same text in a text frame */
+  multicast(clients, num_clients, msg, LUV_FRAME_TEXT, msg->base, len);
+  shared_msg_unref(msg);
+}
+
+void luv_server_broadcast(luv_server_t *self, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vmulticast(self->clients, self->num_clients, fmt, ap);
+  va_end(ap);
+}
+
+/* sends to a subset of the clients, formatting the message only once as well */
+void luv_server_multicast(luv_server_t *self, luv_client_t **clients, int num_clients, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vmulticast(clients, num_clients, fmt, ap);
+  va_end(ap);
 }
 
 void luv_server_destroy(luv_server_t *self)
@@ -180,6 +961,14 @@ void luv_server_destroy(luv_server_t *self)
     CHECK(r, "uv_shutdown");
   }
 
+  free(self->clients);
+  free(self->by_id);
+  self->clients = NULL;
+  self->by_id = NULL;
+  self->num_clients = self->clients_cap = self->by_id_cap = 0;
+
+  uv_close((uv_handle_t *)&self->evict_timer, NULL);
+  uv_close((uv_handle_t *)&self->lag_timer, NULL);
   uv_close((uv_handle_t *)self, NULL);
 }
 
@@ -190,6 +979,49 @@ void luv_server_start(luv_server_t *self, uv_loop_t *loop)
   log_info("Listening on %s:%d", self->host, self->port);
 }
 
+/* a client nobody sends to anymore would never be checked again by client_write, so stay over budget forever */
+static void check_budgets(luv_server_t *server)
+{
+  int i;
+  for (i = 0; i < server->num_clients; i++)
+  {
+    if (server->clients[i]->over_budget && !server->clients[i]->evicted)
+      client_check_budget(server->clients[i]);
+  }
+}
+
+/*
+ * A busy loop runs its timers late, how late is the lag.
+ * Every RATE_PROBES probes the rates are updated and slow clients are checked for eviction as well.
+ */
+static void lag_cb(uv_timer_t *timer)
+{
+  luv_server_t *server = timer->data;
+  uint64_t now = uv_hrtime();
+  double secs;
+
+  server->loop_lag = now > server->lag_due ? (now - server->lag_due) / 1000 : 0;
+  if (server->loop_lag > server->window_lag)
+    server->window_lag = server->loop_lag;
+  server->lag_due = now + LAG_PROBE_MS * 1000000ULL;
+
+  if (++server->probes < RATE_PROBES)
+    return;
+
+  secs = (now - server->window_start) / 1e9;
+  server->msgs_in_rate = (server->msgs_in - server->window_msgs_in) / secs;
+  server->msgs_out_rate = (server->msgs_out - server->window_msgs_out) / secs;
+  server->max_loop_lag = server->window_lag;
+  server->window_lag = 0;
+  server->probes = 0;
+  server->window_start = now;
+  server->window_msgs_in = server->msgs_in;
+  server->window_msgs_out = server->msgs_out;
+
+  if (server->max_queued && server->evict_timeout)
+    check_budgets(server);
+}
+
 void luv_server_init(
     luv_server_t *self, uv_loop_t *loop, const char *host, int port, luv_onclient_connected onclient_connected, luv_onclient_disconnected onclient_disconnected, luv_onclient_msg onclient_msg)
 {
@@ -197,7 +1029,31 @@ void luv_server_init(
 
   self->host = host;
   self->port = port;
+  self->clients = NULL;
   self->num_clients = 0;
+  self->clients_cap = 0;
+  self->by_id = NULL;
+  self->by_id_cap = 0;
+  self->max_clients = DEFAULT_MAX_CLIENTS;
+  self->ids = 0;
+  self->id_stride = 1;
+  self->max_queued = DEFAULT_MAX_QUEUED;
+  self->evict_timeout = DEFAULT_EVICT_TIMEOUT;
+  self->max_in_flight = 0;
+  self->onclient_prepare = NULL;
+  self->onclient_work = NULL;
+  self->queued_bytes = 0;
+  self->coalesced_writes = 0;
+  self->evictions = 0;
+  self->accepts = self->rejects = self->disconnects = 0;
+  self->bytes_in = self->bytes_out = 0;
+  self->msgs_in = self->msgs_out = 0;
+  memset(self->queue_buckets, 0, sizeof(self->queue_buckets));
+  self->loop_lag = self->max_loop_lag = self->window_lag = 0;
+  self->probes = 0;
+  self->msgs_in_rate = self->msgs_out_rate = 0;
+  self->window_start = uv_hrtime();
+  self->window_msgs_in = self->window_msgs_out = 0;
   self->onclient_connected = onclient_connected;
   self->onclient_disconnected = onclient_disconnected;
   self->onclient_msg = onclient_msg;
@@ -206,6 +1062,25 @@ void luv_server_init(
   r = uv_tcp_init(loop, &self->tcp);
   CHECK(r, "uv_tcp_init");
 
+  // http://docs.libuv.org/en/latest/timer.html#c.uv_timer_init
+  r = uv_timer_init(loop, &self->evict_timer);
+  CHECK(r, "uv_timer_init");
+  self->evict_timer.data = self;
+
+  /* the probe shouldn't keep the loop alive on its own */
+  r = uv_timer_init(loop, &self->lag_timer);
+  CHECK(r, "uv_timer_init");
+  self->lag_timer.data = self;
+  self->lag_due = uv_hrtime() + LAG_PROBE_MS * 1000000ULL;
+  r = uv_timer_start(&self->lag_timer, lag_cb, LAG_PROBE_MS, LAG_PROBE_MS);
+  CHECK(r, "uv_timer_start");
+  // http://docs.libuv.org/en/latest/handle.html#c.uv_unref
+  uv_unref((uv_handle_t *)&self->lag_timer);
+
+  /* servers without a host only get connections handed to them with luv_server_open */
+  if (host == NULL)
+    return;
+
   /* Bind to localhost:7001 */
   struct sockaddr_in addr;
   r = uv_ip4_addr(host, port, &addr);
@@ -70,56 +70,59 @@ static void horse_draw(luv_horse_t *self)
   refresh();
 }
 
-static void add_player(uv_loop_t *loop, luv_player_t *player)
+static void add_player(luv_game_t *game, luv_player_t *player)
 {
-  luv_horse_t *horse = horses + player->track;
+  luv_horse_t *horse = &game->horses[player->track];
+  *horse = horses[player->track];
   horse->position = 0;
-  player->horse = horse;
   player->speed = 0;
 
-  log_info("Queued horse %s on track: %d", horse->name, horse->track);
+  log_info("Queued horse %s on track: %d in room %d", horse->name, horse->track, game->id);
   if (DRAW)
-    horse_draw(player->horse);
+    horse_draw(horse);
 }
 
-static void update_player(int rand_num, luv_player_t *player)
+static void update_player(int rand_num, luv_game_t *game, luv_player_t *player, uint64_t tick)
 {
-  luv_horse_t *horse = player->horse;
+  luv_horse_t *horse = &game->horses[player->track];
 
   if (rand_num > player->speed)
     return;
   horse->position++;
-  log_info("Horse %s progresses to position %d.", horse->name, horse->position);
+  luv_recorder_position(game->recorder, game, tick, horse);
+  log_info("Horse %s progresses to position %d in room %d.", horse->name, horse->position, game->id);
   if (DRAW)
-    horse_draw(player->horse);
+    horse_draw(horse);
 }
 
-void track_handler(uv_idle_t *handle)
+void track_handler(luv_game_t *game, uint64_t tick)
 {
   int i;
-  luv_game_t *game = handle->data;
 
   if (!game->in_progress)
     return;
-  if (--(game->delay) > 0)
+  if (tick < game->track_tick)
     return;
 
-  game->delay = DELAY;
+  game->track_tick = tick + TRACK_TICKS;
 
-  luv_server_t *server = game->server;
-
-  luv_client_t **clients = server->clients;
-  int rand_num = (rand() % MAX_SPEED) + 1;
-  for (i = 0; i < server->num_clients; i++)
-    update_player(rand_num, clients[i]->data);
+  int rand_num = luv_rand_below(&game->rng, MAX_SPEED) + 1;
+  for (i = 0; i < game->num_players; i++)
+    update_player(rand_num, game, game->players[i]->data, tick);
 }
 
-void track_init(uv_loop_t *loop, luv_client_t **clients, int num_players)
+void track_init(luv_game_t *game)
 {
   int i;
-  if (DRAW)
+  static int screen_ready = 0;
+
+  /* all rooms share the one screen */
+  if (DRAW && !screen_ready)
+  {
     init_screen();
+    screen_ready = 1;
+  }
 
-  for (i = 0; i < num_players; i++)
-    add_player(loop, clients[i]->data);
+  for (i = 0; i < game->num_players; i++)
+    add_player(game, game->players[i]->data);
 }
@@ -0,0 +1,210 @@
+#include "luv_framer.h"
+#include "uv.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void luv_framer_init(luv_framer_t *self, size_t max_frame)
+{
+  self->buf = NULL;
+  self->len = 0;
+  self->max_frame = max_frame;
+  self->discarding = 0;
+  self->mode = LUV_FRAMER_LINES;
+  self->skip = 0;
+}
+
+void luv_framer_set_mode(luv_framer_t *self, int mode)
+{
+  self->mode = mode;
+  self->len = 0;
+  self->discarding = 0;
+  self->skip = 0;
+}
+
+void luv_framer_destroy(luv_framer_t *self)
+{
+  free(self->buf);
+  self->buf = NULL;
+  self->len = 0;
+}
+
+const char *luv_framer_pending(luv_framer_t *self, size_t *len)
+{
+  *len = self->len;
+  return self->len > 0 ? self->buf : NULL;
+}
+
+static int emit(const char *frame, size_t len, luv_framer_cb cb, void *data)
+{
+  if (len > 0 && frame[len - 1] == '\r')
+    len--;
+  return cb(data, frame, len);
+}
+
+/* Buffers `len` more bytes of the current line, returns UV_ENOBUFS once it grows beyond `max_frame` */
+static int append(luv_framer_t *self, const char *buf, size_t len)
+{
+  if (self->discarding)
+    return 0;
+
+  if (self->len + len > self->max_frame)
+  {
+    self->len = 0;
+    self->discarding = 1;
+    return UV_ENOBUFS;
+  }
+
+  if (self->buf == NULL)
+  {
+    /* room for the length prefix as well */
+    self->buf = malloc(self->max_frame + 2);
+    if (self->buf == NULL)
+      return UV_ENOMEM;
+  }
+
+  memcpy(self->buf + self->len, buf, len);
+  self->len += len;
+  return 0;
+}
+
+static size_t read_be16(const char *buf)
+{
+  return ((size_t)(unsigned char)buf[0] << 8) | (unsigned char)buf[1];
+}
+
+static int feed_length(luv_framer_t *self, const char *buf, const char *end, luv_framer_cb cb, void *data)
+{
+  int r, err = 0;
+  size_t n, need;
+
+  while (buf < end)
+  {
+    if (self->skip > 0)
+    {
+      n = (size_t)(end - buf) < self->skip ? (size_t)(end - buf) : self->skip;
+      self->skip -= n;
+      buf += n;
+      continue;
+    }
+
+    /* frames that are complete within this read are handed out in place */
+    if (self->len == 0 && end - buf >= 2)
+    {
+      need = read_be16(buf);
+      if (need > self->max_frame)
+      {
+        err = UV_ENOBUFS;
+        self->skip = need;
+        buf += 2;
+        continue;
+      }
+      if ((size_t)(end - buf) >= 2 + need)
+      {
+        r = cb(data, buf + 2, need);
+        buf += 2 + need;
+        if (r)
+          return r;
+        continue;
+      }
+    }
+
+    /* the frame continues in a later read, buffer it including its length */
+    if (self->len < 2)
+    {
+      n = 2 - self->len < (size_t)(end - buf) ? 2 - self->len : (size_t)(end - buf);
+      r = append(self, buf, n);
+      if (r)
+        return r;
+      buf += n;
+      if (self->len < 2)
+        break;
+      if (read_be16(self->buf) > self->max_frame)
+      {
+        err = UV_ENOBUFS;
+        self->skip = read_be16(self->buf);
+        self->len = 0;
+        continue;
+      }
+    }
+
+    need = 2 + read_be16(self->buf) - self->len;
+    n = need < (size_t)(end - buf) ? need : (size_t)(end - buf);
+    memcpy(self->buf + self->len, buf, n);
+    self->len += n;
+    buf += n;
+    if (n == need)
+    {
+      self->len = 0;
+      r = cb(data, self->buf + 2, read_be16(self->buf));
+      if (r)
+        return r;
+    }
+  }
+  return err;
+}
+
+int luv_framer_feed(luv_framer_t *self, const char *buf, size_t len, luv_framer_cb cb, void *data)
+{
+  int r, err = 0;
+  const char *end = buf + len;
+  const char *nl;
+
+  if (self->mode == LUV_FRAMER_LENGTH)
+    return feed_length(self, buf, end, cb, data);
+
+  /* finish the line started by earlier reads, that's the only one we have to copy */
+  if (self->len > 0 || self->discarding)
+  {
+    nl = memchr(buf, '\n', len);
+    r = append(self, buf, nl == NULL ? len : (size_t)(nl - buf));
+    if (r)
+      err = r;
+    if (nl == NULL)
+      return err;
+
+    buf = nl + 1;
+    if (self->discarding)
+    {
+      self->discarding = 0;
+    }
+    else
+    {
+      r = emit(self->buf, self->len, cb, data);
+      self->len = 0;
+      if (r)
+        return r;
+      if (self->mode == LUV_FRAMER_LENGTH)
+        return feed_length(self, buf, end, cb, data);
+    }
+  }
+
+  /* lines that are complete within this read are handed out in place */
+  while (buf < end && (nl = memchr(buf, '\n', end - buf)) != NULL)
+  {
+    if ((size_t)(nl - buf) > self->max_frame)
+    {
+      err = UV_ENOBUFS;
+    }
+    else
+    {
+      r = emit(buf, nl - buf, cb, data);
+      if (r)
+        return r;
+      if (self->mode == LUV_FRAMER_LENGTH)
+      {
+        r = feed_length(self, nl + 1, end, cb, data);
+        return r ? r : err;
+      }
+    }
+    buf = nl + 1;
+  }
+
+  if (buf < end)
+  {
+    r = append(self, buf, end - buf);
+    if (r)
+      err = r;
+  }
+  return err;
+}
@@ -0,0 +1,42 @@
+#ifndef __LUV_FRAMER_H__
+#define __LUV_FRAMER_H__
+
+#include <stddef.h>
+
+/*
+ * Incremental newline-delimited framer.
+ * Feed it whatever a read returned and it calls back once per complete line, without the trailing "\n" or "\r\n".
+ * Lines that are complete within one read are handed out in place, pointing into the caller's buffer.
+ * Only the unterminated tail of a read is buffered, so a line split across reads is copied once.
+ * Lines longer than `max_frame` are dropped up to their newline and reported as UV_ENOBUFS.
+ *
+ * In LUV_FRAMER_LENGTH mode frames are instead prefixed with their length as 2 byte big endian integer, which isn't
+ * part of the frame handed out. The mode may be switched from within the callback, the rest of the read is then framed
+ * the new way. That's how a connection negotiates a binary protocol with a line.
+ */
+
+#define LUV_FRAMER_LINES 0
+#define LUV_FRAMER_LENGTH 1
+
+/* return non-zero to stop framing, luv_framer_feed then returns that value */
+typedef int (*luv_framer_cb)(void *data, const char *frame, size_t len);
+
+typedef struct
+{
+  char *buf;        /* holds the tail of a line that isn't complete yet, allocated on first use */
+  size_t len;       /* bytes in `buf` */
+  size_t max_frame; /* `buf` holds this many bytes */
+  int discarding;   /* we're skipping the rest of an oversize line */
+  int mode;
+  size_t skip; /* bytes left of an oversize length prefixed frame */
+} luv_framer_t;
+
+void luv_framer_init(luv_framer_t *, size_t max_frame);
+int luv_framer_feed(luv_framer_t *, const char *buf, size_t len, luv_framer_cb cb, void *data);
+void luv_framer_destroy(luv_framer_t *);
+void luv_framer_set_mode(luv_framer_t *, int mode);
+
+/* the start of the line which isn't terminated yet, NULL if there is none */
+const char *luv_framer_pending(luv_framer_t *, size_t *len);
+
+#endif
@@ -0,0 +1,45 @@
+#include "luv_hist.h"
+
+static int hist_index(uint64_t v)
+{
+  int shift;
+  if (v < HIST_SUB)
+    return v;
+  shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+  return shift * HIST_HALF + (v >> shift);
+}
+
+/* highest value that lands in the bucket, so percentiles never under-report */
+static uint64_t hist_value(int index)
+{
+  int shift;
+  if (index < HIST_SUB)
+    return index;
+  shift = index / HIST_HALF - 1;
+  return ((uint64_t)(index - shift * HIST_HALF + 1) << shift) - 1;
+}
+
+void luv_hist_record(luv_hist_t *h, uint64_t v)
+{
+  h->counts[hist_index(v)]++;
+  h->total++;
+  if (v > h->max)
+    h->max = v;
+}
+
+uint64_t luv_hist_percentile(luv_hist_t *h, double percentile)
+{
+  int i;
+  uint64_t seen = 0;
+  uint64_t rank = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+
+  if (rank < 1)
+    rank = 1;
+  for (i = 0; i < HIST_BUCKETS; i++)
+  {
+    seen += h->counts[i];
+    if (seen >= rank)
+      return hist_value(i) < h->max ? hist_value(i) : h->max;
+  }
+  return h->max;
+}
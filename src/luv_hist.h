@@ -0,0 +1,27 @@
+#ifndef __LUV_HIST_H__
+#define __LUV_HIST_H__
+
+#include <stdint.h>
+
+/*
+ * HDR-style latency histogram, the unit is up to the caller.
+ * Values below HIST_SUB get a bucket each, above that every power of two is split into HIST_SUB / 2 linear buckets,
+ * so each recorded value is off by less than 1/64th no matter its magnitude.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_HALF + HIST_HALF)
+
+typedef struct
+{
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+} luv_hist_t;
+
+void luv_hist_record(luv_hist_t *, uint64_t v);
+/* highest value of the bucket the percentile falls in, so it never under-reports */
+uint64_t luv_hist_percentile(luv_hist_t *, double percentile);
+
+#endif
@@ -0,0 +1,52 @@
+#include "luv_rand.h"
+
+static uint64_t rotl(uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+/* spreads the seed over the whole state, as recommended by the xoshiro authors */
+static uint64_t splitmix64(uint64_t *x)
+{
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+void luv_rand_seed(luv_rand_t *self, uint64_t seed, uint64_t stream)
+{
+  int i;
+  uint64_t x = seed ^ splitmix64(&stream);
+  for (i = 0; i < 4; i++)
+    self->s[i] = splitmix64(&x);
+}
+
+uint64_t luv_rand_next(luv_rand_t *self)
+{
+  uint64_t *s = self->s;
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+
+  return result;
+}
+
+/* scales the top 32 bits instead of taking a modulo, see https://arxiv.org/abs/1805.10941 */
+uint32_t luv_rand_below(luv_rand_t *self, uint32_t bound)
+{
+  return ((luv_rand_next(self) >> 32) * bound) >> 32;
+}
+
+void luv_rand_fill(luv_rand_t *self, uint32_t *out, size_t n, uint32_t bound)
+{
+  size_t i;
+  for (i = 0; i < n; i++)
+    out[i] = luv_rand_below(self, bound);
+}
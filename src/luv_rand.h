@@ -0,0 +1,25 @@
+#ifndef __LUV_RAND_H__
+#define __LUV_RAND_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * xoshiro256** pseudo random numbers, http://prng.di.unimi.it
+ * Every thread, horse or room keeps its own state, so drawing needs no locks and a run is reproducible from its seed.
+ * Not suitable for anything that has to be unpredictable.
+ */
+typedef struct
+{
+  uint64_t s[4];
+} luv_rand_t;
+
+/* states seeded with the same seed but different streams are independent of each other */
+void luv_rand_seed(luv_rand_t *, uint64_t seed, uint64_t stream);
+uint64_t luv_rand_next(luv_rand_t *);
+/* in [0, bound), the bias is below bound / 2^32 */
+uint32_t luv_rand_below(luv_rand_t *, uint32_t bound);
+/* the same `n` numbers that many luv_rand_below calls would return */
+void luv_rand_fill(luv_rand_t *, uint32_t *out, size_t n, uint32_t bound);
+
+#endif